@@ -0,0 +1,437 @@
+/*
+ *  6526 CIA emulation (shadow of the two CIAs in the C64)
+ *
+ *  All registers are shadowed from the writes seen on the bus. The timers
+ *  and the TOD clock are not clocked every cycle, they are evaluated from
+ *  the cycle counter when a register is accessed. The cycle of the next
+ *  IRQ assertion is predicted, so interrupts can be anticipated.
+ *
+ * Incompatibilities:
+ * ------------------
+ *
+ *  - Timers counting CNT pulses are stopped
+ *  - Serial port and FLAG pin interrupts are not emulated
+ *  - The TOD clock is derived from the CPU clock, the real one
+ *    runs from the mains frequency
+ *  - TOD quirks (writing 12 to the hours flips AM/PM, invalid
+ *    BCD values) are not emulated
+ */
+
+#include "6526.h"
+
+
+/*
+ *  Helpers for cycle stamps, they wrap around
+ */
+
+inline static bool cycle_reached(uint32_t cycle, uint32_t now)
+{
+	return (int32_t)(now - cycle) >= 0;
+}
+
+inline static uint8_t to_bcd(uint32_t value)
+{
+	return ((value / 10) << 4) | (value % 10);
+}
+
+inline static uint32_t from_bcd(uint8_t bcd)
+{
+	return (bcd >> 4) * 10 + (bcd & 0x0f);
+}
+
+
+/*
+ *  Number of cycles between TOD ticks, the TOD input is the mains
+ *  frequency divided by 5 (if set to 50 Hz) or 6 (if set to 60 Hz)
+ */
+
+inline static uint32_t tod_period(mos6526_state *cia)
+{
+	return mains_period * (cia->cra & 0x80 ? 5 : 6);
+}
+
+
+/*
+ *  Convert TOD time to the 10ths, seconds, minutes and hours registers
+ */
+
+static void tod_to_bcd(uint32_t tod, uint8_t *t)
+{
+	uint32_t seconds = tod / TOD_FREQ;
+	uint32_t hours = seconds / 3600 % 24;
+
+	t[0] = tod % TOD_FREQ;
+	t[1] = to_bcd(seconds % 60);
+	t[2] = to_bcd(seconds / 60 % 60);
+	t[3] = to_bcd(hours % 12 ? hours % 12 : 12) | (hours >= 12 ? 0x80 : 0);
+}
+
+static uint32_t bcd_to_tod(const uint8_t *t)
+{
+	uint32_t hours = from_bcd(t[3] & 0x1f) % 12 + (t[3] & 0x80 ? 12 : 0);
+	uint32_t seconds = (hours * 60 + from_bcd(t[2] & 0x7f)) * 60 + from_bcd(t[1] & 0x7f);
+
+	return (seconds * TOD_FREQ + (t[0] & 0x0f) % TOD_FREQ) % TOD_DAY;
+}
+
+
+/*
+ *  Reset the CIA
+ */
+
+static void reset6526(mos6526_state *cia)
+{
+	cia->pra = cia->prb = cia->ddra = cia->ddrb = 0;
+	cia->latcha = cia->latchb = 0xffff;
+	cia->ta = cia->tb = 0xffff;
+	cia->ta_next = cia->tb_next = 0;
+	cia->ta_run = cia->tb_run = false;
+	cia->sdr = cia->cra = cia->crb = 0;
+	cia->icr = cia->int_mask = 0;
+
+	cia->tod = 1*60*60*TOD_FREQ;	// 1:00:00.0 AM
+	cia->tod_cycle = cycle_counter;
+	cia->alarm = 0;
+	cia->tod_halt = cia->tod_latched = false;
+
+	cia->irq = false;
+	cia->irq_cycle = 0;
+	cia->mismatches = 0;
+}
+
+
+/*
+ *  Current timer values
+ */
+
+inline static uint16_t timer_a(mos6526_state *cia, uint32_t now)
+{
+	if (cia->ta_run)
+		return cia->ta_next - now - 1;
+	else
+		return cia->ta;
+}
+
+inline static uint16_t timer_b(mos6526_state *cia, uint32_t now)
+{
+	if (cia->tb_run && !(cia->crb & 0x40))
+		return cia->tb_next - now - 1;
+	else
+		return cia->tb;
+}
+
+
+/*
+ *  Set interrupt flag, assert IRQ if the interrupt is enabled
+ */
+
+static void set_icr(mos6526_state *cia, uint8_t bit, uint32_t cycle)
+{
+	cia->icr |= bit;
+
+	if (cia->int_mask & bit) {
+		cycle += TIMER_IRQ_DELAY;
+		if (!(cia->icr & ICR_IR) || !cycle_reached(cia->irq_cycle, cycle)) {
+			cia->icr |= ICR_IR;
+			cia->irq = true;
+			cia->irq_cycle = cycle;
+		}
+	}
+}
+
+
+/*
+ *  Predict the next IRQ assertion, if not already asserted
+ */
+
+static void predict_candidate(mos6526_state *cia, uint32_t cycle)
+{
+	cycle += TIMER_IRQ_DELAY;
+	if (!cia->irq || !cycle_reached(cia->irq_cycle, cycle)) {
+		cia->irq = true;
+		cia->irq_cycle = cycle;
+	}
+}
+
+static void predict_irq(mos6526_state *cia)
+{
+	if (cia->icr & ICR_IR)
+		return;
+
+	cia->irq = false;
+
+	if ((cia->int_mask & ICR_TA) && cia->ta_run)
+		predict_candidate(cia, cia->ta_next);
+
+	if ((cia->int_mask & ICR_TB) && cia->tb_run) {
+		if (!(cia->crb & 0x40))
+			predict_candidate(cia, cia->tb_next);
+		else if (cia->ta_run && (!(cia->cra & 0x08) || cia->tb == 0))
+			predict_candidate(cia, cia->ta_next + cia->tb * (cia->latcha + 1));
+	}
+
+	if ((cia->int_mask & ICR_ALARM) && !cia->tod_halt) {
+		uint64_t ticks = (cia->alarm + TOD_DAY - cia->tod) % TOD_DAY;
+		uint64_t cycles = (ticks ? ticks : TOD_DAY) * tod_period(cia);
+
+		// Too far ahead for the cycle counter, predicted again later
+		if (cycles < 0x40000000)
+			predict_candidate(cia, cia->tod_cycle + (uint32_t)cycles);
+	}
+}
+
+
+/*
+ *  Timer B counts n underflows of timer A, the first at cycle first
+ */
+
+static void count_tb(mos6526_state *cia, uint32_t first, uint32_t period, uint32_t n)
+{
+	if (n <= cia->tb) {
+		cia->tb -= n;
+		return;
+	}
+
+	// Underflow at the (TB+1)th underflow of timer A
+	set_icr(cia, ICR_TB, first + cia->tb * period);
+	n -= cia->tb + 1;
+
+	if (cia->crb & 0x08) {	// One-shot
+		cia->tb_run = false;
+		cia->crb &= 0xfe;
+		cia->tb = cia->latchb;
+	} else
+		cia->tb = cia->latchb - n % (cia->latchb + 1);
+}
+
+
+/*
+ *  Bring timers and TOD clock up to date. Called on every register access
+ *  and regularly to keep the cycle stamps within range of the cycle counter
+ */
+
+static void update_6526(mos6526_state *cia, uint32_t now)
+{
+	// Timer A underflows
+	if (cia->ta_run && cycle_reached(cia->ta_next, now)) {
+		uint32_t period = cia->latcha + 1;
+		uint32_t first = cia->ta_next;
+		uint32_t n;
+
+		if (cia->cra & 0x08) {	// One-shot
+			n = 1;
+			cia->ta_run = false;
+			cia->cra &= 0xfe;
+			cia->ta = cia->latcha;
+		} else {
+			n = (now - first) / period + 1;
+			cia->ta_next = first + n * period;
+		}
+
+		set_icr(cia, ICR_TA, first);
+		if (cia->tb_run && (cia->crb & 0x40))
+			count_tb(cia, first, period, n);
+	}
+
+	// Timer B underflows when counting Phi2
+	if (cia->tb_run && !(cia->crb & 0x40) && cycle_reached(cia->tb_next, now)) {
+		uint32_t period = cia->latchb + 1;
+		uint32_t first = cia->tb_next;
+
+		if (cia->crb & 0x08) {	// One-shot
+			cia->tb_run = false;
+			cia->crb &= 0xfe;
+			cia->tb = cia->latchb;
+		} else
+			cia->tb_next = first + ((now - first) / period + 1) * period;
+
+		set_icr(cia, ICR_TB, first);
+	}
+
+	// TOD ticks and alarm
+	if (!cia->tod_halt) {
+		uint32_t period = tod_period(cia);
+		uint32_t ticks = (now - cia->tod_cycle) / period;
+
+		if (ticks) {
+			uint32_t to_alarm = (cia->alarm + TOD_DAY - cia->tod) % TOD_DAY;
+			if (to_alarm == 0)
+				to_alarm = TOD_DAY;
+			if (to_alarm <= ticks)
+				set_icr(cia, ICR_ALARM, cia->tod_cycle + to_alarm * period);
+
+			cia->tod = (cia->tod + ticks) % TOD_DAY;
+			cia->tod_cycle += ticks * period;
+		}
+	}
+
+
+	if (!cia->irq)
+		predict_irq(cia);
+}
+
+
+/*
+ *  IRQ line is asserted at the given cycle (according to the prediction)
+ */
+
+inline static bool irq_asserted_6526(mos6526_state *cia, uint32_t at_cycle)
+{
+	return cia->irq && cycle_reached(cia->irq_cycle, at_cycle);
+}
+
+
+/*
+ *  Read from register. The real value is on the bus, it is compared with
+ *  the emulated one and the read side effects are applied
+ */
+
+static uint8_t read_register_6526(mos6526_state *cia, uint16_t adr, uint8_t data)
+{
+	uint32_t now = cycle_counter;
+	uint8_t expected = data;
+
+	update_6526(cia, now);
+
+	switch (adr) {
+		case 0x4: expected = timer_a(cia, now); break;
+		case 0x5: expected = timer_a(cia, now) >> 8; break;
+		case 0x6: expected = timer_b(cia, now); break;
+		case 0x7: expected = timer_b(cia, now) >> 8; break;
+
+		case 0x8:	// Reading the 10ths releases the latch
+			cia->tod_latched = false;
+			break;
+
+		case 0xb:	// Reading the hours latches the time
+			if (!cia->tod_latched) {
+				tod_to_bcd(cia->tod, cia->tod_latch);
+				cia->tod_latched = true;
+			}
+			break;
+
+		case 0xd:	// Reading ICR clears all flags and IRQ
+			expected = cia->icr & 0x1f;
+			if (irq_asserted_6526(cia, now))
+				expected |= ICR_IR;
+			cia->icr = 0;
+			cia->irq = false;
+			predict_irq(cia);
+			break;
+	}
+
+	if (expected != data)
+		cia->mismatches++;
+
+	return data;
+}
+
+
+/*
+ *  Write to register
+ */
+
+static void write_register_6526(mos6526_state *cia, uint16_t adr, uint8_t byte)
+{
+	uint32_t now = cycle_counter;
+
+	update_6526(cia, now);
+
+	switch (adr) {
+		case 0x0: cia->pra = byte; break;
+		case 0x1: cia->prb = byte; break;
+		case 0x2: cia->ddra = byte; break;
+		case 0x3: cia->ddrb = byte; break;
+
+		case 0x4:
+			cia->latcha = (cia->latcha & 0xff00) | byte;
+			break;
+
+		case 0x5:
+			cia->latcha = (cia->latcha & 0xff) | (byte << 8);
+			if (!(cia->cra & 0x01))	// Load counter if timer is stopped
+				cia->ta = cia->latcha;
+			break;
+
+		case 0x6:
+			cia->latchb = (cia->latchb & 0xff00) | byte;
+			break;
+
+		case 0x7:
+			cia->latchb = (cia->latchb & 0xff) | (byte << 8);
+			if (!(cia->crb & 0x01))
+				cia->tb = cia->latchb;
+			break;
+
+		case 0x8: case 0x9: case 0xa: case 0xb:{
+			uint8_t t[4];
+
+			tod_to_bcd(cia->crb & 0x80 ? cia->alarm : cia->tod, t);
+			t[adr - 8] = byte;
+
+			if (cia->crb & 0x80)
+				cia->alarm = bcd_to_tod(t);
+			else {
+				cia->tod = bcd_to_tod(t);
+				cia->tod_cycle = now;
+
+				// Writing the hours stops the clock until the 10ths are written
+				if (adr == 0xb)
+					cia->tod_halt = true;
+				else if (adr == 0x8)
+					cia->tod_halt = false;
+			}
+			break;
+		}
+
+		case 0xc:
+			cia->sdr = byte;
+			break;
+
+		case 0xd:
+			if (byte & 0x80)
+				cia->int_mask |= byte & 0x1f;
+			else
+				cia->int_mask &= ~byte;
+
+			// Trigger interrupt if pending and now allowed
+			if ((cia->icr & cia->int_mask & 0x1f) && !(cia->icr & ICR_IR)) {
+				cia->icr |= ICR_IR;
+				cia->irq = true;
+				cia->irq_cycle = now + TIMER_IRQ_DELAY;
+			}
+			break;
+
+		case 0xe:{
+			uint16_t value = byte & 0x10 ? cia->latcha : timer_a(cia, now);
+			bool run = (byte & 0x01) && !(byte & 0x20);
+
+			if (!run)
+				cia->ta = value;
+			else if (!cia->ta_run || (byte & 0x10))
+				cia->ta_next = now + TIMER_START_DELAY + value;
+
+			cia->ta_run = run;
+			cia->cra = byte & 0xef;
+			break;
+		}
+
+		case 0xf:{
+			uint16_t value = byte & 0x10 ? cia->latchb : timer_b(cia, now);
+			bool run = (byte & 0x01) && (byte & 0x60) != 0x20;
+			bool phi2 = run && !(byte & 0x40);
+			bool was_phi2 = cia->tb_run && !(cia->crb & 0x40);
+
+			if (!phi2)
+				cia->tb = value;
+			else if (!was_phi2 || (byte & 0x10))
+				cia->tb_next = now + TIMER_START_DELAY + value;
+
+			cia->tb_run = run;
+			cia->crb = byte & 0xef;
+			break;
+		}
+	}
+
+	predict_irq(cia);
+}
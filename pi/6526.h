@@ -0,0 +1,68 @@
+/*
+ *  6526 CIA emulation (shadow of the two CIAs in the C64)
+ */
+
+// Number of cycles from writing a start or load to the first decrement
+static const uint32_t TIMER_START_DELAY = 2;
+
+// Number of cycles from a timer underflow until IRQ is asserted
+static const uint32_t TIMER_IRQ_DELAY = 2;
+
+// TOD clock ticks per second
+static const uint32_t TOD_FREQ = 10;
+
+// Number of TOD ticks in a day (the clock wraps at midnight)
+static const uint32_t TOD_DAY = 24*60*60*TOD_FREQ;
+
+// ICR bits
+enum {
+	ICR_TA = 0x01,		// Timer A underflow
+	ICR_TB = 0x02,		// Timer B underflow
+	ICR_ALARM = 0x04,	// TOD alarm
+	ICR_SP = 0x08,		// Serial port
+	ICR_FLAG = 0x10,	// FLAG pin
+	ICR_IR = 0x80		// Interrupt asserted
+};
+
+// CIA state
+struct mos6526_state
+{
+	// Registers
+	uint8_t pra, prb, ddra, ddrb;
+	uint16_t latcha, latchb;	// Timer latches
+	uint8_t sdr;				// Serial data register
+	uint8_t cra, crb;			// Control registers
+	uint8_t icr;				// Interrupt data, read and cleared by the CPU
+	uint8_t int_mask;			// Interrupt mask
+
+	// Timers, evaluated lazily from the cycle counter
+	uint16_t ta, tb;			// Counter value while stopped, TB count when counting TA
+	uint32_t ta_next, tb_next;	// Cycle of the next underflow while counting Phi2
+	bool ta_run, tb_run;		// Flag: Timer counts Phi2 (or TA underflows for TB)
+
+	// TOD clock, evaluated lazily from the cycle counter
+	uint32_t tod;				// Time in 1/10 s at tod_cycle
+	uint32_t tod_cycle;
+	uint32_t alarm;				// Alarm time in 1/10 s
+	bool tod_halt;				// Flag: Stopped by writing the hours
+	bool tod_latched;			// Flag: Read value latched by reading the hours
+	uint8_t tod_latch[4];		// Latched time (10ths, seconds, minutes, hours)
+
+	// Interrupt prediction
+	bool irq;					// Flag: IRQ is asserted (or predicted) at irq_cycle
+	uint32_t irq_cycle;
+
+	uint32_t mismatches;		// Reads that differ from the emulated value
+};
+
+static mos6526_state cia1, cia2;
+
+// Number of cycles in a period of the mains frequency, set for the model
+static uint32_t mains_period;
+
+static void reset6526(mos6526_state *cia);
+
+static uint8_t read_register_6526(mos6526_state *cia, uint16_t adr, uint8_t data);
+static void write_register_6526(mos6526_state *cia, uint16_t adr, uint8_t byte);
+
+static bool irq_asserted_6526(mos6526_state *cia, uint32_t at_cycle);
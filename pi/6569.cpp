@@ -10,20 +10,27 @@
  *  - Changes to border/background color are visible 7 pixels
  *    too late
  *  - Sprite data access doesn't respect BA
- *  - Sprite collisions are only detected within the visible
- *    screen area (excluding borders)
- *  - Sprites are only drawn if they completely fit within the
- *    left/right limits of the chunky bitmap
+ *  - Sprite-graphics collisions are not detected in the upper
+ *    and lower border
+ *  - Sprite collisions are detected when the line is drawn in
+ *    cycle 60, the IRQ is asserted at the cycle of the first
+ *    colliding pixel
  */
 
 #include "6569.h"
 
-static const bool SpritesOn = true;         // Sprite display is on
-static const bool SpriteCollisions = false; // Sprite collision detection is off
+// Pixel kernels, selected by the instruction set the emulator is built for
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-// First and last displayed line
-static const int FIRST_DISP_LINE = 0x10;
-static const int LAST_DISP_LINE = 0x11f;
+static const bool SpritesOn = true;         // Sprite display is on
+static const bool SpriteCollisions = true;  // Sprite collision detection is on
+static const int RasterThreads = 2;         // Max. threads drawing the lines (0: lines are drawn by the emulation)
 
 // First and last possible line for Bad Lines
 static const int FIRST_DMA_LINE = 0x30;
@@ -112,6 +119,41 @@ static const uint16_t MultiExpTable[256] = {
 	0xFFA0, 0xFFA5, 0xFFAA, 0xFFAF, 0xFFF0, 0xFFF5, 0xFFFA, 0xFFFF
 };
 
+// Display state of a line from first_cycle on, until the next segment
+struct line_segment
+{
+	uint8_t first_cycle;
+	uint8_t display_idx;
+	uint8_t x_scroll;
+	pixel_t ec_color, b0c_color, b1c_color, b2c_color, b3c_color;
+};
+
+// A new segment starts in each cycle 13..60 at most
+static const int MAX_SEGMENTS = 48;
+
+// Everything needed to draw a line, recorded while the line is emulated
+struct line_record
+{
+	pixel_t *line;							// Start of the line in the bitmap
+	uint8_t gfx_data[40];					// Data of the graphics accesses
+	uint8_t char_data[40];
+	uint8_t color_data[40];
+	uint8_t start_char_data;				// last_char_data at the start of the line
+	bool ud_border_first;					// ud_border_on when the first column is displayed
+	bool ud_border_on;						// ud_border_on for the rest of the line
+	bool border_on_sample[5];				// Samples of border state
+	int num_segments;
+	line_segment segments[MAX_SEGMENTS];
+
+	uint8_t spr_draw, mxe, mmc, mdp;		// Sprite state in cycle 60
+	int16_t spr_x[8];						// Position of the sprites in the line
+	uint8_t spr_data[8][4];
+	pixel_t spr_color[8];
+	pixel_t mm0_color, mm1_color;
+
+	uint64_t emulated_ns;					// Time the line was emulated (for latency stats)
+};
+
 static uint16_t mx[8];						// VIC registers
 static uint8_t my[8];
 static uint8_t mx8;
@@ -123,19 +165,21 @@ static uint8_t irq_flag, irq_mask;
 static uint8_t clx_spr, clx_bgr;
 static uint8_t sc[8];
 
-static uint32_t colors[256];			// The 16 C64 colors (16 times mirrored to avoid "& 0x0f")
+static pixel_t colors[256];			// The 16 C64 colors (16 times mirrored to avoid "& 0x0f")
+
+#ifdef INDEXED_DISPLAY
+static uint64_t pixel_mask[256];		// Graphics byte expanded to a mask of 8 pixels
+#endif
 
-static uint32_t ec_color, b0c_color, b1c_color, b2c_color, b3c_color; // Exterior/background colors
-static uint32_t mm0_color, mm1_color;	// MOB multicolors
-static uint32_t spr_color[8];			// MOB colors
+static pixel_t ec_color, b0c_color, b1c_color, b2c_color, b3c_color; // Exterior/background colors
+static pixel_t mm0_color, mm1_color;	// MOB multicolors
+static pixel_t spr_color[8];			// MOB colors
 
 static uint8_t matrix_line[40];			// Buffer for video line, read in Bad Lines
 static uint8_t color_line[40];			// Buffer for color line, read in Bad Lines
 
-static uint32_t *chunky_ptr;			// Pointer in chunky bitmap buffer
-static uint32_t *chunky_line_start;		// Pointer to start of current line in bitmap buffer
-static uint8_t *fore_mask_ptr;			// Pointer in fore_mask_buf
-static int xmod;						// Number of bytes per row
+static pixel_t *chunky_line_start;		// Pointer to start of current line in bitmap buffer
+static int xmod;						// Number of pixels per row
 
 static uint16_t raster_x;				// Current raster x position
 static uint16_t raster_y;				// Current raster line
@@ -149,7 +193,7 @@ static uint16_t x_scroll;				// X scroll value
 static uint16_t y_scroll;				// Y scroll value
 static uint16_t cia_vabase;				// CIA VA14/15 video base
 
-static int cycle;						// Current cycle in line (1..63)
+static int cycle;						// Current cycle in line (1..63/64/65)
 
 static int display_idx;					// Index of current display mode
 static int ml_index;					// Index in matrix/color_line[]
@@ -157,8 +201,8 @@ static int ml_index;					// Index in matrix/color_line[]
 static uint16_t mc[8];					// Sprite data counters
 static uint16_t mc_base[8];				// Sprite data counter bases
 
-static uint8_t spr_coll_buf[0x180];		// Buffer for sprite-sprite collisions and priorities
-static uint8_t fore_mask_buf[0x180/8];	// Foreground mask for sprite-graphics collisions and priorities
+static uint32_t clx_spr_read, clx_bgr_read;	// Cycles the collision registers were last read
+static uint32_t clx_mismatches;			// Collision register reads that differ from the emulated value
 
 static bool display_state;				// true: Display state, false: Idle state
 static bool border_on;					// Flag: Upper/lower border on
@@ -170,7 +214,6 @@ static bool ud_border_on;				// Flag: Upper/lower border on
 static bool vblanking;					// Flag: VBlank in next cycle
 
 static bool border_on_sample[5];		// Samples of border state at different cycles (1, 17, 18, 56, 57)
-static uint32_t border_color_sample[DISPLAY_X/8];	// Samples of border color at each "displayed" cycle
 
 static uint16_t matrix_base;			// Video matrix base
 static uint16_t char_base;				// Character generator base
@@ -185,26 +228,44 @@ static uint16_t spr_ptr[8];				// Sprite data pointers
 
 static uint8_t gfx_data, char_data, color_data, last_char_data;
 static uint8_t spr_data[8][4];			// Sprite data read
-static uint8_t spr_draw_data[8][4];		// Sprite data for drawing
+static line_record *line_rec;			// Record of the current line
+static line_record line_scratch;		// Record of a line that isn't drawn
+static bool line_open;					// Flag: Display state changes are recorded
 
 static uint32_t first_ba_cycle;			// Cycle when BA first went low
 static uint8_t LastVICByte;
 
+static uint8_t reg_bytes[0x40];			// Last bytes written to the VIC registers
+static uint8_t frame_changes;			// VIC_CHANGED_* flags of the current frame
+static uint8_t last_frame_changes;		// VIC_CHANGED_* flags of the last complete frame
+static bool frame_dirty;				// Flag: Change affecting the display in this frame
+static int unchanged_frames;			// Number of frames without changes affecting the display
+static bool reuse_pixels;				// Flag: Bitmap still holds the pixels of this frame
+static bool frame_skipped;				// Flag: The pixels of this frame aren't drawn
+
+static void add_segment(int first_cycle);
+static void start_raster_threads(void);
+static void raster_sync(void);
+
 /*
  *  Initialize variables
  */
 
-static void reset6569()
+template <class M> static void reset6569()
 {
 	int i;
 
+	// Start the raster threads, lines may still be drawn with the old colors
+	start_raster_threads();
+	raster_sync();
+
 	// Set pointers
 	matrix_base = 0;
 	char_base = 0;
 	bitmap_base = 0;
 
 	// Get bitmap info
-	chunky_ptr = chunky_line_start = display_bitmap_base;
+	chunky_line_start = display_bitmap_base;
 	xmod = display_bitmap_xmod;
 
 	// Initialize VIC registers
@@ -214,11 +275,13 @@ static void reset6569()
 	me = mxe = mye = mdp = mmc = 0;
 	vbase = irq_flag = irq_mask = 0;
 	clx_spr = clx_bgr = 0;
+	clx_spr_read = clx_bgr_read = cycle_counter;
+	clx_mismatches = 0;
 	cia_vabase = 0;
 	for (i=0; i<8; i++) mx[i] = my[i] = sc[i] = 0;
 
 	// Initialize other variables
-	raster_y = TOTAL_RASTERS - 1;
+	raster_y = M::TOTAL_RASTERS - 1;
 	rc = 7;
 	irq_raster = vc = vc_base = x_scroll = y_scroll = 0;
 	dy_start = ROW24_YSTART;
@@ -229,7 +292,13 @@ static void reset6569()
 	display_idx = 0;
 	display_state = false;
 	border_on = ud_border_on = vblanking = false;
-	lp_triggered = draw_this_line = false;
+	lp_triggered = draw_this_line = line_open = false;
+	line_rec = &line_scratch;
+
+	memset(reg_bytes, 0, sizeof(reg_bytes));
+	frame_changes = last_frame_changes = 0;
+	frame_dirty = reuse_pixels = frame_skipped = false;
+	unchanged_frames = 0;
 
 	spr_dma_on = spr_disp_on = 0;
 	for (i=0; i<8; i++) {
@@ -237,12 +306,13 @@ static void reset6569()
 		spr_ptr[i] = 0;
 	}
 
-	memset(spr_coll_buf, 0, 0x180);
-	memset(fore_mask_buf, 0, 0x180/8);
-
 	for (int i=0; i<256; i++)
 	{
-		colors[i] = palette[i & 0x0f];
+		colors[i] = display_color(i & 0x0f);
+#ifdef INDEXED_DISPLAY
+		for (int j=0; j<8; j++)
+			((uint8_t *)&pixel_mask[i])[j] = (i & (0x80 >> j)) ? 0xff : 0;
+#endif
 	}
 	
 	// Preset colors to black
@@ -268,12 +338,88 @@ static inline void raster_irq(void)
 }
 
 
+/*
+ *  Note VIC-relevant changes, stop reusing the pixels of the last frame
+ *  if the change affects the current display mode
+ */
+
+inline static void note_changes(uint8_t flags)
+{
+	frame_changes |= flags;
+
+	if (flags & ~(ctrl1 & 0x20 ? VIC_CHANGED_CHARSET : VIC_CHANGED_BITMAP)) {
+		frame_dirty = true;
+		reuse_pixels = false;
+	}
+}
+
+
+/*
+ *  Read from VIC register. The real value is on the bus, the collision
+ *  registers are compared with the emulated ones and cleared
+ */
+
+static uint8_t read_register_6569(uint16_t adr, uint8_t data)
+{
+	switch (adr) {
+		case 0x1e:	// Sprite-sprite collisions
+			if (SpriteCollisions && data != clx_spr)
+				clx_mismatches++;
+			clx_spr = 0;
+			clx_spr_read = cycle_counter;
+			break;
+
+		case 0x1f:	// Sprite-background collisions
+			if (SpriteCollisions && data != clx_bgr)
+				clx_mismatches++;
+			clx_bgr = 0;
+			clx_bgr_read = cycle_counter;
+			break;
+	}
+
+	return data;
+}
+
+
 /*
  *  Write to VIC register
  */
 
 static void write_register_6569(uint16_t adr, uint8_t byte)
 {
+	bool new_segment = false;
+
+	if (line_open)
+		switch (adr) {
+			case 0x11:	// Display mode
+				new_segment = (byte ^ ctrl1) & 0x60;
+				break;
+			case 0x16:	// Display mode, X scroll
+				new_segment = (byte ^ ctrl2) & 0x17;
+				break;
+			case 0x20: case 0x21: case 0x22: case 0x23: case 0x24:	// Border and background colors
+				new_segment = (byte ^ reg_bytes[adr]) & 0x0f;
+				break;
+		}
+
+	if (byte != reg_bytes[adr]) {
+		switch (adr) {
+			case 0x11:	// Raster compare bit doesn't affect the display
+				if ((byte ^ reg_bytes[adr]) & 0x7f)
+					note_changes(VIC_CHANGED_REGS);
+				break;
+			case 0x12: case 0x13: case 0x14:	// Raster compare, lightpen
+			case 0x19: case 0x1a:				// IRQ flags and mask
+			case 0x1e: case 0x1f:				// Collisions
+				break;
+			default:
+				if (adr < 0x2f)
+					note_changes(VIC_CHANGED_REGS);
+				break;
+		}
+		reg_bytes[adr] = byte;
+	}
+
 	switch (adr) {
 		case 0x00: case 0x02: case 0x04: case 0x06:
 		case 0x08: case 0x0a: case 0x0c: case 0x0e:
@@ -399,6 +545,10 @@ static void write_register_6569(uint16_t adr, uint8_t byte)
 			spr_color[adr - 0x27] = colors[sc[adr - 0x27] = byte];
 			break;
 	}
+
+	// The line is drawn with the new state from this cycle on
+	if (new_segment)
+		add_segment(cycle);
 }
 
 
@@ -408,11 +558,95 @@ static void write_register_6569(uint16_t adr, uint8_t byte)
 
 static void changed_va_6569(uint16_t new_va)
 {
+	if (cia_vabase != new_va << 14)
+		note_changes(VIC_CHANGED_REGS);
+
 	cia_vabase = new_va << 14;
 	write_register_6569(0x18, vbase); // Force update of memory pointers
 }
 
 
+/*
+ *  First write to a RAM page in this frame, find out what the VIC uses it for
+ */
+
+static void changed_page_6569(uint8_t page)
+{
+	uint16_t adr = page << 8;
+	uint8_t flags = 0;
+
+	// Outside the VIC bank or hidden by the character ROM?
+	if ((adr & 0xc000) != cia_vabase || (adr & 0x7000) == 0x1000)
+		return;
+
+	if ((adr & 0x3c00) == matrix_base)
+		flags |= VIC_CHANGED_MATRIX;
+	if ((adr & 0x3800) == char_base)
+		flags |= VIC_CHANGED_CHARSET;
+	if ((adr & 0x2000) == bitmap_base)
+		flags |= VIC_CHANGED_BITMAP;
+	if ((adr & 0x3f00) == 0x3f00 || (adr & 0x3f00) == 0x3900)
+		flags |= VIC_CHANGED_IDLE;
+
+	for (int i=0; i<8; i++)
+		if (me & (1 << i)) {
+			uint16_t va = cia_vabase | matrix_base | 0x03f8 | i;
+			uint8_t ptr = (va & 0x7000) == 0x1000 ? char_rom[va & 0x0fff] : ram[va];
+			if (((ptr << 6) & 0x3f00) == (adr & 0x3f00))
+				flags |= VIC_CHANGED_SPRITES;
+		}
+
+	if (flags)
+		note_changes(flags);
+}
+
+
+/*
+ *  Color RAM has changed
+ */
+
+static void changed_color_ram_6569(void)
+{
+	note_changes(VIC_CHANGED_COLOR);
+}
+
+
+/*
+ *  Changes of the last complete frame
+ */
+
+inline static uint8_t vic_frame_changes(void)
+{
+	return last_frame_changes;
+}
+
+
+/*
+ *  Last frame was drawn without any changes, so it is identical to the one before
+ */
+
+inline static bool vic_frame_unchanged(void)
+{
+	return unchanged_frames >= 3;
+}
+
+
+/*
+ *  Don't draw the pixels of the next frame (everything else is emulated),
+ *  or draw them again
+ */
+
+inline static void vic_skip_frame(bool skip)
+{
+	frame_skipped = skip;
+}
+
+inline static bool vic_frame_skipped(void)
+{
+	return frame_skipped;
+}
+
+
 /*
  *  Read a byte from the VIC's address space
  */
@@ -429,14 +663,196 @@ inline static uint8_t read_byte(uint16_t adr)
 
 
 /*
- *  Quick memset of 8 bytes
+ *  Pixel kernels: Fill 8 pixels with one color, expand a standard (one bit
+ *  per pixel) or multicolor (two bits per two pixels) graphics byte to 8
+ *  pixels. The colors are selected with vector compares and the pixels are
+ *  written with one or two vector stores, with a scalar fallback.
+ *  With color indexes, the 8 pixels are one 64 bit word selected by masks
+ *  from a table
  */
 
+#if defined(INDEXED_DISPLAY)
+
+inline static uint64_t repeat8(pixel_t c)
+{
+	return c * 0x0101010101010101ULL;
+}
+
+inline static void memset8(pixel_t *p, pixel_t c)
+{
+	uint64_t v = repeat8(c);
+
+	memcpy(p, &v, 8);
+}
+
+inline static void expand_std(pixel_t *p, uint8_t gfx, pixel_t c0, pixel_t c1)
+{
+	uint64_t v0 = repeat8(c0);
+	uint64_t v = v0 ^ ((v0 ^ repeat8(c1)) & pixel_mask[gfx]);
+
+	memcpy(p, &v, 8);
+}
+
+inline static void expand_multi(pixel_t *p, uint8_t gfx, const pixel_t *c)
+{
+	uint64_t lo = pixel_mask[(gfx & 0x55) | (gfx & 0x55) << 1];
+	uint64_t hi = pixel_mask[(gfx & 0xaa) | (gfx & 0xaa) >> 1];
+	uint64_t v01 = repeat8(c[0]) ^ ((repeat8(c[0]) ^ repeat8(c[1])) & lo);
+	uint64_t v23 = repeat8(c[2]) ^ ((repeat8(c[2]) ^ repeat8(c[3])) & lo);
+	uint64_t v = v01 ^ ((v01 ^ v23) & hi);
+
+	memcpy(p, &v, 8);
+}
+
+#elif defined(__AVX2__)
+
+inline static void memset8(uint32_t *p, uint32_t c)
+{
+	_mm256_storeu_si256((__m256i *)p, _mm256_set1_epi32(c));
+}
+
+inline static void expand_std(uint32_t *p, uint8_t gfx, uint32_t c0, uint32_t c1)
+{
+	const __m256i bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	__m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(gfx), bits), bits);
+	__m256i v0 = _mm256_set1_epi32(c0);
+
+	_mm256_storeu_si256((__m256i *)p, _mm256_xor_si256(v0, _mm256_and_si256(set, _mm256_xor_si256(v0, _mm256_set1_epi32(c1)))));
+}
+
+inline static void expand_multi(uint32_t *p, uint8_t gfx, const uint32_t *c)
+{
+	const __m256i hi_bits = _mm256_setr_epi32(0x80, 0x80, 0x20, 0x20, 0x08, 0x08, 0x02, 0x02);
+	const __m256i lo_bits = _mm256_setr_epi32(0x40, 0x40, 0x10, 0x10, 0x04, 0x04, 0x01, 0x01);
+	__m256i g = _mm256_set1_epi32(gfx);
+	__m256i hi = _mm256_cmpeq_epi32(_mm256_and_si256(g, hi_bits), hi_bits);
+	__m256i lo = _mm256_cmpeq_epi32(_mm256_and_si256(g, lo_bits), lo_bits);
+	__m256i c01 = _mm256_blendv_epi8(_mm256_set1_epi32(c[0]), _mm256_set1_epi32(c[1]), lo);
+	__m256i c23 = _mm256_blendv_epi8(_mm256_set1_epi32(c[2]), _mm256_set1_epi32(c[3]), lo);
+
+	_mm256_storeu_si256((__m256i *)p, _mm256_blendv_epi8(c01, c23, hi));
+}
+
+#elif defined(__SSE2__)
+
+// Select b where mask is set, otherwise a
+inline static __m128i select_128(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+}
+
+inline static void memset8(uint32_t *p, uint32_t c)
+{
+	__m128i v = _mm_set1_epi32(c);
+
+	_mm_storeu_si128((__m128i *)p, v);
+	_mm_storeu_si128((__m128i *)(p + 4), v);
+}
+
+inline static void expand_std(uint32_t *p, uint8_t gfx, uint32_t c0, uint32_t c1)
+{
+	const __m128i bits_l = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+	const __m128i bits_r = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+	__m128i g = _mm_set1_epi32(gfx);
+	__m128i v0 = _mm_set1_epi32(c0);
+	__m128i v1 = _mm_set1_epi32(c1);
+
+	_mm_storeu_si128((__m128i *)p, select_128(_mm_cmpeq_epi32(_mm_and_si128(g, bits_l), bits_l), v0, v1));
+	_mm_storeu_si128((__m128i *)(p + 4), select_128(_mm_cmpeq_epi32(_mm_and_si128(g, bits_r), bits_r), v0, v1));
+}
+
+inline static void expand_multi(uint32_t *p, uint8_t gfx, const uint32_t *c)
+{
+	const __m128i hi_bits_l = _mm_setr_epi32(0x80, 0x80, 0x20, 0x20);
+	const __m128i lo_bits_l = _mm_setr_epi32(0x40, 0x40, 0x10, 0x10);
+	const __m128i hi_bits_r = _mm_setr_epi32(0x08, 0x08, 0x02, 0x02);
+	const __m128i lo_bits_r = _mm_setr_epi32(0x04, 0x04, 0x01, 0x01);
+	__m128i g = _mm_set1_epi32(gfx);
+	__m128i v0 = _mm_set1_epi32(c[0]);
+	__m128i v1 = _mm_set1_epi32(c[1]);
+	__m128i v2 = _mm_set1_epi32(c[2]);
+	__m128i v3 = _mm_set1_epi32(c[3]);
+	__m128i hi, lo;
+
+	hi = _mm_cmpeq_epi32(_mm_and_si128(g, hi_bits_l), hi_bits_l);
+	lo = _mm_cmpeq_epi32(_mm_and_si128(g, lo_bits_l), lo_bits_l);
+	_mm_storeu_si128((__m128i *)p, select_128(hi, select_128(lo, v0, v1), select_128(lo, v2, v3)));
+	hi = _mm_cmpeq_epi32(_mm_and_si128(g, hi_bits_r), hi_bits_r);
+	lo = _mm_cmpeq_epi32(_mm_and_si128(g, lo_bits_r), lo_bits_r);
+	_mm_storeu_si128((__m128i *)(p + 4), select_128(hi, select_128(lo, v0, v1), select_128(lo, v2, v3)));
+}
+
+#elif defined(__ARM_NEON)
+
+inline static void memset8(uint32_t *p, uint32_t c)
+{
+	uint32x4_t v = vdupq_n_u32(c);
+
+	vst1q_u32(p, v);
+	vst1q_u32(p + 4, v);
+}
+
+inline static void expand_std(uint32_t *p, uint8_t gfx, uint32_t c0, uint32_t c1)
+{
+	static const uint32_t bits[8] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+	uint32x4_t g = vdupq_n_u32(gfx);
+	uint32x4_t v0 = vdupq_n_u32(c0);
+	uint32x4_t v1 = vdupq_n_u32(c1);
+
+	vst1q_u32(p, vbslq_u32(vtstq_u32(g, vld1q_u32(bits)), v1, v0));
+	vst1q_u32(p + 4, vbslq_u32(vtstq_u32(g, vld1q_u32(bits + 4)), v1, v0));
+}
+
+inline static void expand_multi(uint32_t *p, uint8_t gfx, const uint32_t *c)
+{
+	static const uint32_t hi_bits[8] = {0x80, 0x80, 0x20, 0x20, 0x08, 0x08, 0x02, 0x02};
+	static const uint32_t lo_bits[8] = {0x40, 0x40, 0x10, 0x10, 0x04, 0x04, 0x01, 0x01};
+	uint32x4_t g = vdupq_n_u32(gfx);
+	uint32x4_t v0 = vdupq_n_u32(c[0]);
+	uint32x4_t v1 = vdupq_n_u32(c[1]);
+	uint32x4_t v2 = vdupq_n_u32(c[2]);
+	uint32x4_t v3 = vdupq_n_u32(c[3]);
+	uint32x4_t hi, lo;
+
+	hi = vtstq_u32(g, vld1q_u32(hi_bits));
+	lo = vtstq_u32(g, vld1q_u32(lo_bits));
+	vst1q_u32(p, vbslq_u32(hi, vbslq_u32(lo, v3, v2), vbslq_u32(lo, v1, v0)));
+	hi = vtstq_u32(g, vld1q_u32(hi_bits + 4));
+	lo = vtstq_u32(g, vld1q_u32(lo_bits + 4));
+	vst1q_u32(p + 4, vbslq_u32(hi, vbslq_u32(lo, v3, v2), vbslq_u32(lo, v1, v0)));
+}
+
+#else
+
 inline static void memset8(uint32_t *p, uint32_t c)
 {
 	p[0] = p[1] = p[2] = p[3] = p[4] = p[5] = p[6] = p[7] = c;
 }
 
+inline static void expand_std(uint32_t *p, uint8_t gfx, uint32_t c0, uint32_t c1)
+{
+	uint32_t c[2] = {c0, c1};
+
+	p[7] = c[gfx & 1]; gfx >>= 1;
+	p[6] = c[gfx & 1]; gfx >>= 1;
+	p[5] = c[gfx & 1]; gfx >>= 1;
+	p[4] = c[gfx & 1]; gfx >>= 1;
+	p[3] = c[gfx & 1]; gfx >>= 1;
+	p[2] = c[gfx & 1]; gfx >>= 1;
+	p[1] = c[gfx & 1]; gfx >>= 1;
+	p[0] = c[gfx];
+}
+
+inline static void expand_multi(uint32_t *p, uint8_t gfx, const uint32_t *c)
+{
+	p[7] = p[6] = c[gfx & 3]; gfx >>= 2;
+	p[5] = p[4] = c[gfx & 3]; gfx >>= 2;
+	p[3] = p[2] = c[gfx & 3]; gfx >>= 2;
+	p[1] = p[0] = c[gfx];
+}
+
+#endif
+
 
 /*
  *  Video matrix access
@@ -483,6 +899,10 @@ inline static void graphics_access(void)
 		gfx_data = read_byte(ctrl1 & 0x40 ? 0x39ff : 0x3fff);
 		char_data = color_data = 0;
 	}
+
+	line_rec->gfx_data[cycle-16] = gfx_data;
+	line_rec->char_data[cycle-16] = char_data;
+	line_rec->color_data[cycle-16] = color_data;
 }
 
 
@@ -490,34 +910,30 @@ inline static void graphics_access(void)
  *  Background display (8 pixels)
  */
 
-static void draw_background(void)
+static void draw_background(pixel_t *p, const line_segment *s, uint8_t last_char)
 {
-	uint32_t *p = chunky_ptr;
-	uint32_t c;
-
-	if (!draw_this_line)
-		return;
+	pixel_t c;
 
-	switch (display_idx) {
+	switch (s->display_idx) {
 		case 0:		// Standard text
 		case 1:		// Multicolor text
 		case 3:		// Multicolor bitmap
-			c = b0c_color;
+			c = s->b0c_color;
 			break;
 		case 2:		// Standard bitmap
-			c = colors[last_char_data];
+			c = colors[last_char];
 			break;
 		case 4:		// ECM text
-			if (last_char_data & 0x80)
-				if (last_char_data & 0x40)
-					c = b3c_color;
+			if (last_char & 0x80)
+				if (last_char & 0x40)
+					c = s->b3c_color;
 				else
-					c = b2c_color;
+					c = s->b2c_color;
 			else
-				if (last_char_data & 0x40)
-					c = b1c_color;
+				if (last_char & 0x40)
+					c = s->b1c_color;
 				else
-					c = b0c_color;
+					c = s->b0c_color;
 			break;
 		default:
 			c = colors[0];
@@ -531,356 +947,682 @@ static void draw_background(void)
  *  Graphics display (8 pixels)
  */
 
-inline static void draw_graphics(void)
+inline static void draw_graphics(pixel_t *p, const line_segment *s, uint8_t gfx, uint8_t chr, uint8_t col)
 {
-	uint32_t *p = chunky_ptr + x_scroll;
-	uint32_t c[4], data;
+	pixel_t c[4];
 
-	if (!draw_this_line)
-		return;
-	if (ud_border_on) {
-		draw_background();
-		return;
-	}
+	p += s->x_scroll;
 
-	switch (display_idx) {
+	switch (s->display_idx) {
 
 		case 0:		// Standard text
-			c[0] = b0c_color;
-			c[1] = colors[color_data];
-			goto draw_std;
+			expand_std(p, gfx, s->b0c_color, colors[col]);
+			return;
 
 		case 1:		// Multicolor text
-			if (color_data & 8) {
-				c[0] = b0c_color;
-				c[1] = b1c_color;
-				c[2] = b2c_color;
-				c[3] = colors[color_data & 7];
-				goto draw_multi;
-			} else {
-				c[0] = b0c_color;
-				c[1] = colors[color_data];
-				goto draw_std;
-			}
+			if (col & 8) {
+				c[0] = s->b0c_color;
+				c[1] = s->b1c_color;
+				c[2] = s->b2c_color;
+				c[3] = colors[col & 7];
+				expand_multi(p, gfx, c);
+			} else
+				expand_std(p, gfx, s->b0c_color, colors[col]);
+			return;
 
 		case 2:		// Standard bitmap
-			c[0] = colors[char_data];
-			c[1] = colors[char_data >> 4];
-			goto draw_std;
+			expand_std(p, gfx, colors[chr], colors[chr >> 4]);
+			return;
 
 		case 3:		// Multicolor bitmap
-			c[0]= b0c_color;
-			c[1] = colors[char_data >> 4];
-			c[2] = colors[char_data];
-			c[3] = colors[color_data];
-			goto draw_multi;
+			c[0]= s->b0c_color;
+			c[1] = colors[chr >> 4];
+			c[2] = colors[chr];
+			c[3] = colors[col];
+			expand_multi(p, gfx, c);
+			return;
 
 		case 4:		// ECM text
-			if (char_data & 0x80)
-				if (char_data & 0x40)
-					c[0] = b3c_color;
+			if (chr & 0x80)
+				if (chr & 0x40)
+					c[0] = s->b3c_color;
 				else
-					c[0] = b2c_color;
+					c[0] = s->b2c_color;
 			else
-				if (char_data & 0x40)
-					c[0] = b1c_color;
+				if (chr & 0x40)
+					c[0] = s->b1c_color;
 				else
-					c[0] = b0c_color;
-			c[1] = colors[color_data];
-			goto draw_std;
-
-		case 5:		// Invalid multicolor text
-			memset8(p, colors[0]);
-			if (color_data & 8) {
-				fore_mask_ptr[0] |= ((gfx_data & 0xaa) | (gfx_data & 0xaa) >> 1) >> x_scroll;
-				fore_mask_ptr[1] |= ((gfx_data & 0xaa) | (gfx_data & 0xaa) >> 1) << (8-x_scroll);
-			} else {
-				fore_mask_ptr[0] |= gfx_data >> x_scroll;
-				fore_mask_ptr[1] |= gfx_data << (7-x_scroll);
-			}
+					c[0] = s->b0c_color;
+			expand_std(p, gfx, c[0], colors[col]);
 			return;
 
-		case 6:		// Invalid standard bitmap
+		default:	// Invalid modes
 			memset8(p, colors[0]);
-			fore_mask_ptr[0] |= gfx_data >> x_scroll;
-			fore_mask_ptr[1] |= gfx_data << (7-x_scroll);
 			return;
+	}
+}
 
-		case 7:		// Invalid multicolor bitmap
-			memset8(p, colors[0]);
-			fore_mask_ptr[0] |= ((gfx_data & 0xaa) | (gfx_data & 0xaa) >> 1) >> x_scroll;
-			fore_mask_ptr[1] |= ((gfx_data & 0xaa) | (gfx_data & 0xaa) >> 1) << (8-x_scroll);
-			return;
 
-		default:	// Can't happen
-			return;
-	}
+/*
+ *  Graphics display of columns first..last-1 of the display window in one
+ *  pass, for the common modes
+ */
 
-draw_std:
+static void draw_graphics_line(const line_record *r, const line_segment *s, int first, int last)
+{
+	pixel_t *p = r->line + (4+first)*8 + s->x_scroll;
+	pixel_t c[4] = {s->b0c_color, s->b1c_color, s->b2c_color, 0};
+	int i;
 
-	fore_mask_ptr[0] |= gfx_data >> x_scroll;
-	fore_mask_ptr[1] |= gfx_data << (7-x_scroll);
+	switch (s->display_idx) {
+		case 0:		// Standard text
+			for (i=first; i<last; i++, p+=8)
+				expand_std(p, r->gfx_data[i], c[0], colors[r->color_data[i]]);
+			break;
 
-	data = gfx_data;
-	p[7] = c[data & 1]; data >>= 1;
-	p[6] = c[data & 1]; data >>= 1;
-	p[5] = c[data & 1]; data >>= 1;
-	p[4] = c[data & 1]; data >>= 1;
-	p[3] = c[data & 1]; data >>= 1;
-	p[2] = c[data & 1]; data >>= 1;
-	p[1] = c[data & 1]; data >>= 1;
-	p[0] = c[data];
-	return;
+		case 1:		// Multicolor text
+			for (i=first; i<last; i++, p+=8)
+				if (r->color_data[i] & 8) {
+					c[3] = colors[r->color_data[i] & 7];
+					expand_multi(p, r->gfx_data[i], c);
+				} else
+					expand_std(p, r->gfx_data[i], c[0], colors[r->color_data[i]]);
+			break;
 
-draw_multi:
+		case 2:		// Standard bitmap
+			for (i=first; i<last; i++, p+=8)
+				expand_std(p, r->gfx_data[i], colors[r->char_data[i]], colors[r->char_data[i] >> 4]);
+			break;
+
+		default:
+			for (i=first; i<last; i++)
+				draw_graphics(r->line + (4+i)*8, s, r->gfx_data[i], r->char_data[i], r->color_data[i]);
+			break;
+	}
+}
 
-	fore_mask_ptr[0] |= ((gfx_data & 0xaa) | (gfx_data & 0xaa) >> 1) >> x_scroll;
-	fore_mask_ptr[1] |= ((gfx_data & 0xaa) | (gfx_data & 0xaa) >> 1) << (8-x_scroll);
 
-	data = gfx_data;
-	p[7] = p[6] = c[data & 3]; data >>= 2;
-	p[5] = p[4] = c[data & 3]; data >>= 2;
-	p[3] = p[2] = c[data & 3]; data >>= 2;
-	p[1] = p[0] = c[data];
-	return;
+/*
+ *  Draw cycles first..last of a line with the display state of one segment,
+ *  from the data of the graphics accesses. The result is the same as
+ *  drawing them in each cycle
+ */
+
+static void draw_segment(const line_record *r, const line_segment *s, int first, int last)
+{
+	int c, i, i_last;
+
+	// Left border, background of the first column
+	for (c=first; c<=17 && c<=last; c++)
+		draw_background(r->line + (c-13)*8, s, r->start_char_data);
+
+	// Display window
+	if (first <= 17 && last >= 17 && !r->ud_border_first)
+		draw_graphics(r->line + 4*8, s, r->gfx_data[0], r->char_data[0], r->color_data[0]);
+	i = (first > 18 ? first : 18) - 17;
+	i_last = (last < 56 ? last : 56) - 17;
+	if (r->ud_border_on)
+		for (; i<=i_last; i++)
+			draw_background(r->line + (4+i)*8, s, i < 2 ? r->start_char_data : r->char_data[i < 39 ? i : 38]);
+	else if (i <= i_last)
+		draw_graphics_line(r, s, i, i_last + 1);
+
+	// Right border
+	for (c=(first > 57 ? first : 57); c<=last; c++)
+		draw_background(r->line + (c-13)*8, s, r->char_data[38]);
 }
 
 
 /*
- *  Sprite display
+ *  Foreground mask of one graphics byte, for sprite-graphics collisions
+ *  and priorities
  */
 
-inline static void draw_sprites(void)
+inline static void fore_mask(uint8_t *fm, const line_segment *s, uint8_t gfx, uint8_t col)
 {
-	int i;
-	int snum, sbit;		// Sprite number/bit mask
-	int spr_coll=0, gfx_coll=0;
+	int idx = s->display_idx;
 
-	// Clear sprite collision buffer
-	{
-		uint32_t *lp = (uint32_t *)spr_coll_buf - 1;
-		for (i=0; i<DISPLAY_X/4; i++)
-			*++lp = 0;
+	if ((idx & 1) && ((idx & 2) || (col & 8))) {	// Multicolor
+		fm[0] |= ((gfx & 0xaa) | (gfx & 0xaa) >> 1) >> s->x_scroll;
+		fm[1] |= ((gfx & 0xaa) | (gfx & 0xaa) >> 1) << (8-s->x_scroll);
+	} else {
+		fm[0] |= gfx >> s->x_scroll;
+		fm[1] |= gfx << (7-s->x_scroll);
 	}
+}
 
-	// Loop for all sprites
-	for (snum=0, sbit=1; snum<8; snum++, sbit<<=1) {
+static void fore_mask_line(const line_record *r, uint8_t *fm)
+{
+	int n, i, i_last;
 
-		// Is sprite visible?
-		if ((spr_draw & sbit) && mx[snum] <= DISPLAY_X-32) {
-			uint32_t *p = chunky_line_start + mx[snum] + 8;
-			uint8_t *q = spr_coll_buf + mx[snum] + 8;
-			uint32_t color = spr_color[snum];
-
-			// Fetch sprite data and mask
-			uint32_t sdata = (spr_draw_data[snum][0] << 24) | (spr_draw_data[snum][1] << 16) | (spr_draw_data[snum][2] << 8);
-
-			int spr_mask_pos = mx[snum] + 8;	// Sprite bit position in fore_mask_buf
-			
-			uint8_t *fmbp = fore_mask_buf + (spr_mask_pos / 8);
-			int sshift = spr_mask_pos & 7;
-			uint32_t fore_mask = (((*(fmbp+0) << 24) | (*(fmbp+1) << 16) | (*(fmbp+2) << 8)
-				  		    | (*(fmbp+3))) << sshift) | (*(fmbp+4) >> (8-sshift));
-
-			if (mxe & sbit) {		// X-expanded
-				if (mx[snum] > DISPLAY_X-56)
-					continue;
-
-				uint32_t sdata_l = 0, sdata_r = 0, fore_mask_r;
-				fore_mask_r = (((*(fmbp+4) << 24) | (*(fmbp+5) << 16) | (*(fmbp+6) << 8)
-						| (*(fmbp+7))) << sshift) | (*(fmbp+8) >> (8-sshift));
-
-				if (mmc & sbit) {	// Multicolor mode
-					uint32_t plane0_l, plane0_r, plane1_l, plane1_r;
-
-					// Expand sprite data
-					sdata_l = MultiExpTable[sdata >> 24 & 0xff] << 16 | MultiExpTable[sdata >> 16 & 0xff];
-					sdata_r = MultiExpTable[sdata >> 8 & 0xff] << 16;
-
-					// Convert sprite chunky pixels to bitplanes
-					plane0_l = (sdata_l & 0x55555555) | (sdata_l & 0x55555555) << 1;
-					plane1_l = (sdata_l & 0xaaaaaaaa) | (sdata_l & 0xaaaaaaaa) >> 1;
-					plane0_r = (sdata_r & 0x55555555) | (sdata_r & 0x55555555) << 1;
-					plane1_r = (sdata_r & 0xaaaaaaaa) | (sdata_r & 0xaaaaaaaa) >> 1;
-
-					// Collision with graphics?
-					if ((fore_mask & (plane0_l | plane1_l)) || (fore_mask_r & (plane0_r | plane1_r))) {
-						gfx_coll |= sbit;
-						if (mdp & sbit)	{
-							plane0_l &= ~fore_mask;	// Mask sprite if in background
-							plane1_l &= ~fore_mask;
-							plane0_r &= ~fore_mask_r;
-							plane1_r &= ~fore_mask_r;
-						}
-					}
-
-					// Paint sprite
-					for (i=0; i<32; i++, plane0_l<<=1, plane1_l<<=1) {
-						uint32_t col;
-						if (plane1_l & 0x80000000) {
-							if (plane0_l & 0x80000000)
-								col = mm1_color;
-							else
-								col = color;
-						} else {
-							if (plane0_l & 0x80000000)
-								col = mm0_color;
-							else
-								continue;
-						}
-						if (q[i])
-							spr_coll |= q[i] | sbit;
-						else {
-							p[i] = col;
-							q[i] = sbit;
-						}
-					}
-					for (; i<48; i++, plane0_r<<=1, plane1_r<<=1) {
-						uint32_t col;
-						if (plane1_r & 0x80000000) {
-							if (plane0_r & 0x80000000)
-								col = mm1_color;
-							else
-								col = color;
-						} else {
-							if (plane0_r & 0x80000000)
-								col = mm0_color;
-							else
-								continue;
-						}
-						if (q[i])
-							spr_coll |= q[i] | sbit;
-						else {
-							p[i] = col;
-							q[i] = sbit;
-						}
-					}
-
-				} else {			// Standard mode
-
-					// Expand sprite data
-					sdata_l = ExpTable[sdata >> 24 & 0xff] << 16 | ExpTable[sdata >> 16 & 0xff];
-					sdata_r = ExpTable[sdata >> 8 & 0xff] << 16;
-
-					// Collision with graphics?
-					if ((fore_mask & sdata_l) || (fore_mask_r & sdata_r)) {
-						gfx_coll |= sbit;
-						if (mdp & sbit)	{
-							sdata_l &= ~fore_mask;	// Mask sprite if in background
-							sdata_r &= ~fore_mask_r;
-						}
-					}
-
-					// Paint sprite
-					for (i=0; i<32; i++, sdata_l<<=1)
-						if (sdata_l & 0x80000000) {
-							if (q[i])	// Collision with sprite?
-								spr_coll |= q[i] | sbit;
-							else {		// Draw pixel if no collision
-								p[i] = color;
-								q[i] = sbit;
-							}
-						}
-					for (; i<48; i++, sdata_r<<=1)
-						if (sdata_r & 0x80000000) {
-							if (q[i]) 	// Collision with sprite?
-								spr_coll |= q[i] | sbit;
-							else {		// Draw pixel if no collision
-								p[i] = color;
-								q[i] = sbit;
-							}
-						}
-				}
+	memset(fm, 0, DISPLAY_X/8);
 
-			} else {				// Unexpanded
-
-				if (mmc & sbit) {	// Multicolor mode
-					uint32_t plane0, plane1;
-
-					// Convert sprite chunky pixels to bitplanes
-					plane0 = (sdata & 0x55555555) | (sdata & 0x55555555) << 1;
-					plane1 = (sdata & 0xaaaaaaaa) | (sdata & 0xaaaaaaaa) >> 1;
-
-					// Collision with graphics?
-					if (fore_mask & (plane0 | plane1)) {
-						gfx_coll |= sbit;
-						if (mdp & sbit) {
-							plane0 &= ~fore_mask;	// Mask sprite if in background
-							plane1 &= ~fore_mask;
-						}
-					}
-
-					// Paint sprite
-					for (i=0; i<24; i++, plane0<<=1, plane1<<=1) {
-						uint32_t col;
-						if (plane1 & 0x80000000) {
-							if (plane0 & 0x80000000)
-								col = mm1_color;
-							else
-								col = color;
-						} else {
-							if (plane0 & 0x80000000)
-								col = mm0_color;
-							else
-								continue;
-						}
-						if (q[i])
-							spr_coll |= q[i] | sbit;
-						else {
-							p[i] = col;
-							q[i] = sbit;
-						}
-					}
-
-				} else {			// Standard mode
-
-					// Collision with graphics?
-					if (fore_mask & sdata) {
-						gfx_coll |= sbit;
-						if (mdp & sbit)
-							sdata &= ~fore_mask;	// Mask sprite if in background
-					}
-	
-					// Paint sprite
-					for (i=0; i<24; i++, sdata<<=1)
-						if (sdata & 0x80000000) {
-							if (q[i]) {	// Collision with sprite?
-								spr_coll |= q[i] | sbit;
-							} else {		// Draw pixel if no collision
-								p[i] = color;
-								q[i] = sbit;
-							}
-						}
-				}
+	for (n=0; n<r->num_segments; n++) {
+		const line_segment *s = &r->segments[n];
+		int last = n+1 < r->num_segments ? s[1].first_cycle - 1 : 60;
+
+		i = (s->first_cycle > 17 ? s->first_cycle : 17) - 17;
+		i_last = (last < 56 ? last : 56) - 17;
+		if (i == 0 && i_last >= 0) {
+			if (!r->ud_border_first)
+				fore_mask(fm + 4, s, r->gfx_data[0], r->color_data[0]);
+			i++;
+		}
+		if (!r->ud_border_on)
+			for (; i<=i_last; i++)
+				fore_mask(fm + 4 + i, s, r->gfx_data[i], r->color_data[i]);
+	}
+}
+
+
+/*
+ *  Sprite display and collision detection. All sprites of a line are
+ *  handled as bitplanes of 64 bit words (bit 63 is the leftmost pixel),
+ *  collisions are found with word-wide AND operations
+ */
+
+// Bitplanes span the chunky line plus the sprite positions left and right
+// of it, pixel 0 of the chunky line is bit position SPR_LINE_OFFSET
+static const int SPR_LINE_OFFSET = 128;
+static const int SPR_LINE_WORDS = 10;
+
+// Pixels of the chunky line
+static const uint64_t spr_clip_mask[SPR_LINE_WORDS] = {0, 0, ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL, 0, 0};
+
+inline static void deposit_bits(uint64_t *line, int pos, uint64_t bits)
+{
+	int b = pos + SPR_LINE_OFFSET, sh = b & 63;
+
+	line[b >> 6] |= bits >> sh;
+	if (sh)
+		line[(b >> 6) + 1] |= bits << (64 - sh);
+}
+
+inline static uint64_t extract_bits(const uint64_t *line, int pos)
+{
+	int b = pos + SPR_LINE_OFFSET, sh = b & 63;
+
+	if (sh)
+		return line[b >> 6] << sh | line[(b >> 6) + 1] >> (64 - sh);
+	else
+		return line[b >> 6];
+}
+
+// Bits of the pixels from position first on (relative to a sprite)
+inline static uint64_t bits_from(int first)
+{
+	if (first <= 0)
+		return ~0ULL;
+	else if (first >= 64)
+		return 0;
+	else
+		return ~0ULL >> first;
+}
+
+inline static void draw_sprite_pixels(pixel_t *line, int pos, uint64_t bits, pixel_t color)
+{
+#ifdef INDEXED_DISPLAY
+	// Paint 8 pixels at a time with the pixel masks of the graphics,
+	// if the sprite is within the chunky line
+	if (pos >= 0 && pos <= DISPLAY_X-48) {
+		pixel_t *p = line + pos;
+		uint64_t c = repeat8(color);
+
+		for (; bits; bits <<= 8, p += 8) {
+			uint64_t m = pixel_mask[bits >> 56], v;
+			if (m) {
+				memcpy(&v, p, 8);
+				v = (v & ~m) | (c & m);
+				memcpy(p, &v, 8);
 			}
 		}
+		return;
 	}
+#endif
 
-	if (SpriteCollisions) {
+	while (bits) {
+		int i = __builtin_clzll(bits);
+		line[pos + i] = color;
+		bits &= ~(0x8000000000000000ULL >> i);
+	}
+}
 
-		// Check sprite-sprite collisions
-		if (clx_spr)
-			clx_spr |= spr_coll;
-		else {
-			clx_spr |= spr_coll;
+// Cycle a pixel of the current line is displayed in, relative to cycle 60
+inline static int pixel_cycle(int pos)
+{
+	return 13 + (pos >> 3) - 60;
+}
+
+// First pixel of the current line not seen by a collision register read
+inline static int clx_read_pixel(uint32_t read_cycle)
+{
+	int32_t d = read_cycle - cycle_counter;
+
+	if (d < -63)
+		d = -63;
+	return (d + 48) * 8;
+}
+
+static void draw_sprites(const line_record *r, const uint8_t *fm, bool draw, bool collisions)
+{
+	uint64_t once[SPR_LINE_WORDS] = {0}, twice[SPR_LINE_WORDS] = {0}, fore[SPR_LINE_WORDS] = {0};
+	uint64_t mask[8];
+	int pos[8];
+	int snum, sbit, i;
+	uint8_t spr_coll = 0, gfx_coll = 0;
+	int spr_first = 64, gfx_first = 64;	// First collision pixels, relative to cycle 60 (in cycles)
+
+	// Foreground mask of the chunky line
+	for (i=0; fm && i<DISPLAY_X/64; i++) {
+		uint64_t f;
+		memcpy(&f, fm + i*8, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		f = __builtin_bswap64(f);
+#endif
+		fore[SPR_LINE_OFFSET/64 + i] = f;
+	}
+
+	for (snum=0, sbit=1; snum<8; snum++, sbit<<=1) {
+		uint64_t plane0, plane1, covered, visible;
+
+		mask[snum] = 0;
+		if (!(r->spr_draw & sbit))
+			continue;
+		pos[snum] = r->spr_x[snum];
+
+		// Expand sprite data to the left of a word
+		const uint8_t *d = r->spr_data[snum];
+		uint64_t sdata;
+		if (r->mxe & sbit) {
+			if (r->mmc & sbit)
+				sdata = (uint64_t)MultiExpTable[d[0]] << 48 | (uint64_t)MultiExpTable[d[1]] << 32 | (uint64_t)MultiExpTable[d[2]] << 16;
+			else
+				sdata = (uint64_t)ExpTable[d[0]] << 48 | (uint64_t)ExpTable[d[1]] << 32 | (uint64_t)ExpTable[d[2]] << 16;
+		} else
+			sdata = (uint64_t)d[0] << 56 | (uint64_t)d[1] << 48 | (uint64_t)d[2] << 40;
+
+		// Convert multicolor sprite chunky pixels to bitplanes
+		if (r->mmc & sbit) {
+			plane0 = (sdata & 0x5555555555555555ULL) | (sdata & 0x5555555555555555ULL) << 1;
+			plane1 = (sdata & 0xaaaaaaaaaaaaaaaaULL) | (sdata & 0xaaaaaaaaaaaaaaaaULL) >> 1;
+			mask[snum] = plane0 | plane1;
+		} else
+			plane0 = plane1 = mask[snum] = sdata;
+
+		// Sprites with lower numbers have priority
+		covered = extract_bits(once, pos[snum]);
+		deposit_bits(twice, pos[snum], mask[snum] & covered);
+		deposit_bits(once, pos[snum], mask[snum]);
+
+		if (!draw)
+			continue;
+
+		// Paint sprite, behind the foreground if it has lower priority
+		visible = mask[snum] & ~covered & extract_bits(spr_clip_mask, pos[snum]);
+		if (r->mdp & sbit)
+			visible &= ~extract_bits(fore, pos[snum]);
+		if (r->mmc & sbit) {
+			draw_sprite_pixels(r->line, pos[snum], visible & plane0 & ~plane1, r->mm0_color);
+			draw_sprite_pixels(r->line, pos[snum], visible & plane1 & ~plane0, r->spr_color[snum]);
+			draw_sprite_pixels(r->line, pos[snum], visible & plane0 & plane1, r->mm1_color);
+		} else
+			draw_sprite_pixels(r->line, pos[snum], visible, r->spr_color[snum]);
+	}
+
+	if (!SpriteCollisions || !collisions)
+		return;
+
+	// Pixels seen by the last reads of the collision registers are already cleared
+	int spr_seen = clx_read_pixel(clx_spr_read);
+	int gfx_seen = clx_read_pixel(clx_bgr_read);
+
+	for (snum=0, sbit=1; snum<8; snum++, sbit<<=1) {
+		uint64_t coll;
+
+		if (!mask[snum])
+			continue;
+
+		// Collision with other sprite?
+		coll = mask[snum] & extract_bits(twice, pos[snum]) & bits_from(spr_seen - pos[snum]);
+		if (coll) {
+			spr_coll |= sbit;
+			if (pixel_cycle(pos[snum] + __builtin_clzll(coll)) < spr_first)
+				spr_first = pixel_cycle(pos[snum] + __builtin_clzll(coll));
+		}
+
+		// Collision with graphics?
+		coll = mask[snum] & extract_bits(fore, pos[snum]) & bits_from(gfx_seen - pos[snum]);
+		if (coll) {
+			gfx_coll |= sbit;
+			if (pixel_cycle(pos[snum] + __builtin_clzll(coll)) < gfx_first)
+				gfx_first = pixel_cycle(pos[snum] + __builtin_clzll(coll));
+		}
+	}
+
+	// First sprite-sprite collision since the register was read triggers IRQ
+	if (spr_coll) {
+		if (!clx_spr) {
 			irq_flag |= 0x04;
 			if (irq_mask & 0x04) {
 				irq_flag |= 0x80;
-				vic_trigger_irq();
+				vic_trigger_irq_at(cycle_counter + spr_first);
 			}
 		}
+		clx_spr |= spr_coll;
+	}
 
-		// Check sprite-background collisions
-		if (clx_bgr)
-			clx_bgr |= gfx_coll;
-		else {
-			clx_bgr |= gfx_coll;
+	// First sprite-background collision since the register was read triggers IRQ
+	if (gfx_coll) {
+		if (!clx_bgr) {
 			irq_flag |= 0x02;
 			if (irq_mask & 0x02) {
 				irq_flag |= 0x80;
-				vic_trigger_irq();
+				vic_trigger_irq_at(cycle_counter + gfx_first);
 			}
 		}
+		clx_bgr |= gfx_coll;
+	}
+}
+
+
+/*
+ *  Line drawing. Everything the pixels of a line depend on is recorded in
+ *  cycles 13..60, and the line is drawn from the record
+ */
+
+// Last cycle of segment n of a line
+inline static int segment_last(const line_record *r, int n)
+{
+	return n+1 < r->num_segments ? r->segments[n+1].first_cycle - 1 : 60;
+}
+
+static void draw_border(const line_record *r)
+{
+	pixel_t ec[DISPLAY_X/8];
+	int n, c, i;
+
+	// Border color of each cycle
+	for (n=0; n<r->num_segments; n++)
+		for (c=r->segments[n].first_cycle; c<=segment_last(r, n); c++)
+			ec[c-13] = r->segments[n].ec_color;
+
+	if (r->border_on_sample[0])
+		for (i=0; i<4; i++)
+			memset8(r->line+i*8, ec[i]);
+	if (r->border_on_sample[1])
+		memset8(r->line+4*8, ec[4]);
+	if (r->border_on_sample[2])
+		for (i=5; i<43; i++)
+			memset8(r->line+i*8, ec[i]);
+	if (r->border_on_sample[3])
+		memset8(r->line+43*8, ec[43]);
+	if (r->border_on_sample[4])
+		for (i=44; i<DISPLAY_X/8; i++)
+			memset8(r->line+i*8, ec[i]);
+}
+
+// Flag: The whole line is border (upper/lower border and main border on
+// in all samples), no graphics or sprite pixels are visible
+inline static bool border_line(const line_record *r)
+{
+	return r->ud_border_first && r->ud_border_on &&
+		r->border_on_sample[0] && r->border_on_sample[1] && r->border_on_sample[2] &&
+		r->border_on_sample[3] && r->border_on_sample[4];
+}
+
+static void draw_line(const line_record *r, bool collisions)
+{
+	uint8_t fm[DISPLAY_X/8];
+	int n;
+
+	// Border lines are only filled with the border color, sprites are only
+	// checked for collisions (there is no foreground in the border)
+	if (border_line(r)) {
+		if (collisions)
+			draw_sprites(r, NULL, false, true);
+		draw_border(r);
+		display_line_drawn((r->line - display_bitmap_base) / display_bitmap_xmod);
+		if (LatencyStats)
+			latency_add(LAT_RENDER, latency_now() - r->emulated_ns);
+		return;
+	}
+
+	for (n=0; n<r->num_segments; n++)
+		draw_segment(r, &r->segments[n], r->segments[n].first_cycle, segment_last(r, n));
+
+	// Sprites need the foreground mask for collisions and priorities
+	if (r->spr_draw) {
+		if (collisions || (r->spr_draw & r->mdp)) {
+			fore_mask_line(r, fm);
+			draw_sprites(r, fm, true, collisions);
+		} else
+			draw_sprites(r, NULL, true, false);
+	}
+
+	draw_border(r);
+
+	display_line_drawn((r->line - display_bitmap_base) / display_bitmap_xmod);
+	if (LatencyStats)
+		latency_add(LAT_RENDER, latency_now() - r->emulated_ns);
+}
+
+
+/*
+ *  Raster threads. The emulation fills a ring of line records, the threads
+ *  claim the submitted lines in order and draw them in parallel. Lines not
+ *  claimed by a thread are drawn by the emulation while it waits
+ */
+
+static const int LINE_RING_SIZE = 64;
+static const uint32_t RASTER_WAKE_LINES = 8;	// Pending lines that wake sleeping threads
+static const int RASTER_SPINS = 4096;		// Polls of an idle thread before it sleeps
+
+static line_record line_ring[LINE_RING_SIZE];
+static bool line_busy[LINE_RING_SIZE];		// Flag: Record is submitted and not drawn yet
+static uint32_t lines_submitted, lines_claimed, lines_finished;
+static int raster_threads;					// Number of threads running
+static int raster_sleepers;					// Number of threads waiting for raster_cond
+static bool raster_started;
+static pthread_mutex_t raster_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t raster_cond = PTHREAD_COND_INITIALIZER;
+
+inline static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// Draw the next submitted line, returns false if there is none
+static bool draw_next_line(void)
+{
+	uint32_t n = __atomic_load_n(&lines_claimed, __ATOMIC_RELAXED);
+
+	do {
+		if (n == __atomic_load_n(&lines_submitted, __ATOMIC_ACQUIRE))
+			return false;
+	} while (!__atomic_compare_exchange_n(&lines_claimed, &n, n+1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	draw_line(&line_ring[n % LINE_RING_SIZE], false);
+	__atomic_store_n(&line_busy[n % LINE_RING_SIZE], false, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&lines_finished, 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *raster_thread(void *)
+{
+	for (;;) {
+		for (int spins=0; spins<RASTER_SPINS; spins++)
+			if (draw_next_line())
+				spins = 0;
+			else
+				cpu_relax();
+
+		// Sleep until lines are submitted
+		pthread_mutex_lock(&raster_mutex);
+		__atomic_add_fetch(&raster_sleepers, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&lines_claimed, __ATOMIC_SEQ_CST) == __atomic_load_n(&lines_submitted, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&raster_cond, &raster_mutex);
+		__atomic_sub_fetch(&raster_sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&raster_mutex);
+	}
+	return NULL;
+}
+
+static void start_raster_threads(void)
+{
+	pthread_t thread;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (raster_started)
+		return;
+	raster_started = true;
+
+	// Leave one CPU to the emulation
+	for (int i=0; i<RasterThreads && i<cpus-1; i++)
+		if (pthread_create(&thread, NULL, raster_thread, NULL) == 0) {
+			pthread_detach(thread);
+			raster_threads++;
+		}
+}
+
+static void raster_wake(void)
+{
+	if (__atomic_load_n(&raster_sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&raster_mutex);
+		pthread_cond_broadcast(&raster_cond);
+		pthread_mutex_unlock(&raster_mutex);
+	}
+}
+
+// Record for the next line, waits until it has been drawn
+static line_record *acquire_line(void)
+{
+	int idx = lines_submitted % LINE_RING_SIZE;
+
+	while (__atomic_load_n(&line_busy[idx], __ATOMIC_ACQUIRE))
+		if (!draw_next_line())
+			cpu_relax();
+	return &line_ring[idx];
+}
+
+static void submit_line(void)
+{
+	uint32_t n = lines_submitted + 1;
+
+	__atomic_store_n(&line_busy[(n-1) % LINE_RING_SIZE], true, __ATOMIC_RELAXED);
+	__atomic_store_n(&lines_submitted, n, __ATOMIC_SEQ_CST);
+	if (n - __atomic_load_n(&lines_claimed, __ATOMIC_RELAXED) >= RASTER_WAKE_LINES)
+		raster_wake();
+}
+
+// Wait until all submitted lines are drawn
+static void raster_sync(void)
+{
+	if (!raster_threads)
+		return;
+
+	raster_wake();
+	while (draw_next_line())
+		;
+	while (__atomic_load_n(&lines_finished, __ATOMIC_ACQUIRE) != lines_submitted)
+		cpu_relax();
+}
+
+
+/*
+ *  Record the display state of the current line from cycle first_cycle on
+ */
+
+static void add_segment(int first_cycle)
+{
+	line_segment *s = &line_rec->segments[line_rec->num_segments];
+
+	// Changes in the same cycle replace the state of the last segment
+	if (line_rec->num_segments && s[-1].first_cycle == first_cycle)
+		s--;
+	else
+		line_rec->num_segments++;
+
+	s->first_cycle = first_cycle;
+	s->display_idx = display_idx;
+	s->x_scroll = x_scroll;
+	s->ec_color = ec_color;
+	s->b0c_color = b0c_color;
+	s->b1c_color = b1c_color;
+	s->b2c_color = b2c_color;
+	s->b3c_color = b3c_color;
+}
+
+static void begin_line(void)
+{
+	if (!draw_this_line) {
+		line_rec = &line_scratch;
+		return;
+	}
+
+	line_rec = raster_threads ? acquire_line() : line_ring;
+	line_rec->line = chunky_line_start;
+	line_rec->start_char_data = last_char_data;
+	line_rec->num_segments = 0;
+	line_open = true;
+	add_segment(13);
+}
+
+// Draw the line or pass it to the raster threads, detect sprite collisions
+// also when the pixels aren't drawn
+template <class M> static void end_line(void)
+{
+	bool draw = draw_this_line && !reuse_pixels && !frame_skipped;
+	bool collisions;
+	uint8_t fm[DISPLAY_X/8];
+	int i;
+
+	line_open = false;
+
+	// Sprite state in cycle 60
+	line_rec->spr_draw = SpritesOn ? spr_draw : 0;
+	if (line_rec->spr_draw) {
+		line_rec->mxe = mxe;
+		line_rec->mmc = mmc;
+		line_rec->mdp = mdp;
+
+		// Sprites at lower X coordinates than the leftmost are right of the
+		// others, sprites beyond the wrap are not displayed
+		for (i=0; i<8; i++) {
+			line_rec->spr_x[i] = mx[i] + 8 - (mx[i] >= M::SPR_FIRST_X ? M::SPR_X_WRAP : 0);
+			if (mx[i] >= M::SPR_X_WRAP)
+				line_rec->spr_draw &= ~(1 << i);
+		}
+		memcpy(line_rec->spr_color, spr_color, sizeof(spr_color));
+		line_rec->mm0_color = mm0_color;
+		line_rec->mm1_color = mm1_color;
+	}
+	collisions = SpriteCollisions && line_rec->spr_draw;
+
+	// No graphics in lines that aren't drawn
+	if (!draw_this_line) {
+		if (collisions)
+			draw_sprites(line_rec, NULL, false, true);
+		return;
+	}
+
+	line_rec->ud_border_on = ud_border_on;
+	memcpy(line_rec->border_on_sample, border_on_sample, sizeof(border_on_sample));
+	if (LatencyStats)
+		line_rec->emulated_ns = latency_now();
+
+	if (draw && !raster_threads)
+		draw_line(line_rec, collisions);
+	else {
+		if (collisions) {
+			fore_mask_line(line_rec, fm);
+			draw_sprites(line_rec, fm, false, true);
+		}
+		if (draw)
+			submit_line();
 	}
 }
 
@@ -947,27 +1689,77 @@ inline static void draw_sprites(void)
 	} else if (bytenum == 1) \
 		IdleAccess;
 
-// Sample border color and increment chunky_ptr and fore_mask_ptr
-#define SampleBorder \
-	if (draw_this_line) { \
-		if (border_on) \
-			border_color_sample[cycle-13] = ec_color; \
-		chunky_ptr += 8; \
-		fore_mask_ptr++; \
+// Cycle of the pointer access of sprite num. The accesses of sprite 3 to 7
+// are in cycle 1 to 10 in all models
+template <class M> constexpr int spr_ptr_cycle(int num)
+{
+	return (M::SPR0_CYCLE + num*2 - 1) % M::CYCLES_PER_LINE + 1;
+}
+
+// Cycle BA is set for sprite num, 3 cycles before the pointer access
+template <class M> constexpr int spr_ba_cycle(int num)
+{
+	return (spr_ptr_cycle<M>(num) + M::CYCLES_PER_LINE - 4) % M::CYCLES_PER_LINE + 1;
+}
+
+// Sprites 0..4 with BA set in cycle c
+template <class M> constexpr uint8_t spr_ba_mask(int c, int num = 0)
+{
+	return num > 4 ? 0 : (spr_ba_cycle<M>(num) == c ? 1 << num : 0) | spr_ba_mask<M>(c, num + 1);
+}
+
+// Sprite accesses in cycle 58 and up (idle accesses before sprite 0),
+// set BA for the sprites accessed 3 cycles later
+template <class M, int C> inline static void sprite_cycle(void)
+{
+	const int num = C >= M::SPR0_CYCLE ? (C - M::SPR0_CYCLE) / 2 : 0;
+
+	if (C < M::SPR0_CYCLE)
+		IdleAccess;
+	else if ((C - M::SPR0_CYCLE) % 2 == 0) {
+
+		// Fetch sprite pointer, reset BA if this and the next sprite off
+		SprPtrAccess(num);
+		SprDataAccess(num, 0);
+		if (num > 0 && !(spr_dma_on & (3 << num)))
+			vic_ba_Low = false;
+	} else {
+		SprDataAccess(num, 1);
+		SprDataAccess(num, 2);
 	}
+	DisplayIfBadLine;
+	if (spr_dma_on & spr_ba_mask<M>(C))
+		SetBALow;
+}
+
+// Last cycle of the line, check the vertical border
+inline static bool last_cycle(void)
+{
+	if (raster_y == dy_stop)
+		ud_border_on = true;
+	else
+		if (ctrl1 & 0x10 && raster_y == dy_start)
+			ud_border_on = false;
+
+	raster_x += 8;
+	cycle = 1;
+	return true;
+}
 
 
-static bool emulate_cycle_6569(void)
+template <class M> static bool emulate_cycle_6569(void)
 {
 	uint8_t mask;
 	int i;
 
+	static_assert(spr_ptr_cycle<M>(3) == 1, "Sprite 3 pointer is accessed in cycle 1");
+
 	switch (cycle) {
 
 		// Fetch sprite pointer 3, increment raster counter, trigger raster IRQ,
 		// test for Bad Line, reset BA if sprites 3 and 4 off, read data of sprite 3
 		case 1:
-			if (raster_y == TOTAL_RASTERS-1)
+			if (raster_y == M::TOTAL_RASTERS-1)
 
 				// Trigger VBlank in cycle 2
 				vblanking = true;
@@ -989,7 +1781,7 @@ static bool emulate_cycle_6569(void)
 				is_bad_line = (raster_y >= FIRST_DMA_LINE && raster_y <= LAST_DMA_LINE && ((raster_y & 7) == y_scroll) && bad_lines_enabled);
 
 				// Don't draw all lines, hide some at the top and bottom
-				draw_this_line = (raster_y >= FIRST_DISP_LINE && raster_y <= LAST_DISP_LINE);
+				draw_this_line = (raster_y >= M::FIRST_DISP_LINE && raster_y <= M::LAST_DISP_LINE);
 			}
 
 			// First sample of border state
@@ -1011,27 +1803,34 @@ static bool emulate_cycle_6569(void)
 				ref_cnt = 0xff;
 				lp_triggered = vblanking = false;
 
-				vic_vblank();
+				last_frame_changes = frame_changes;
+				frame_changes = 0;
+				if (frame_dirty || frame_skipped)
+					unchanged_frames = 0;
+				else if (unchanged_frames < 4)
+					unchanged_frames++;
+				frame_dirty = false;
+				memset(ram_dirty, 0, sizeof(ram_dirty));
+
+				raster_sync();
+				vic_vblank<M>();
 
 				// Get bitmap pointer for next frame. This must be done
-				// after calling the vblank because the preferences
-				// and screen configuration may have been changed there
+				// after calling the vblank because the frame is swapped there
 				chunky_line_start = display_bitmap_base;
 				xmod = display_bitmap_xmod;
 
+				// The pixels in the bitmap can be reused in this frame
+				// (until something changes) if nothing changed in the frame
+				// they were drawn in, the one before and all frames since
+				reuse_pixels = unchanged_frames >= 2 && display_frame_age() <= (uint32_t)unchanged_frames - 2;
+
 				// Trigger raster IRQ if IRQ in line 0
 				if (irq_raster == 0)
 					raster_irq();
 
 			}
 
-			// Our output goes here
-			chunky_ptr = chunky_line_start;
-
-			// Clear foreground mask
-			memset(fore_mask_buf, 0, DISPLAY_X/8);
-			fore_mask_ptr = fore_mask_buf;
-
 			SprDataAccess(3,1);
 			SprDataAccess(3,2);
 			DisplayIfBadLine;
@@ -1122,8 +1921,7 @@ static bool emulate_cycle_6569(void)
 
 		// Refresh, turn on matrix access if Bad Line, reset raster_x, graphics display starts here
 		case 13:
-			draw_background();
-			SampleBorder;
+			begin_line();
 			RefreshAccess;
 			FetchIfBadLine;
 			raster_x = 0xfffc;
@@ -1131,8 +1929,6 @@ static bool emulate_cycle_6569(void)
 
 		// Refresh, VCBASE->VCCOUNT, turn on matrix access and reset RC if Bad Line
 		case 14:
-			draw_background();
-			SampleBorder;
 			RefreshAccess;
 			RCIfBadLine;
 			vc = vc_base;
@@ -1140,8 +1936,6 @@ static bool emulate_cycle_6569(void)
 
 		// Refresh and matrix access, increment mc_base by 2 if y expansion flipflop is set
 		case 15:
-			draw_background();
-			SampleBorder;
 			RefreshAccess;
 			FetchIfBadLine;
 
@@ -1156,8 +1950,6 @@ static bool emulate_cycle_6569(void)
 		// Graphics and matrix access, increment mc_base by 1 if y expansion flipflop is set
 		// and check if sprite DMA can be turned off
 		case 16:
-			draw_background();
-			SampleBorder;
 			graphics_access();
 			FetchIfBadLine;
 
@@ -1192,10 +1984,8 @@ static bool emulate_cycle_6569(void)
 
 			// Second sample of border state
 			border_on_sample[1] = border_on;
+			line_rec->ud_border_first = ud_border_on;
 
-			draw_background();
-			draw_graphics();
-			SampleBorder;
 			graphics_access();
 			FetchIfBadLine;
 			matrix_access();
@@ -1231,8 +2021,6 @@ static bool emulate_cycle_6569(void)
 		case 37: case 38: case 39: case 40: case 41: case 42:
 		case 43: case 44: case 45: case 46: case 47: case 48:
 		case 49: case 50: case 51: case 52: case 53: case 54:	// Gnagna...
-			draw_graphics();
-			SampleBorder;
 			graphics_access();
 			FetchIfBadLine;
 			matrix_access();
@@ -1240,10 +2028,8 @@ static bool emulate_cycle_6569(void)
 			break;
 
 		// Last graphics access, turn off matrix access, turn on sprite DMA if Y coordinate is
-		// right and sprite is enabled, handle sprite y expansion, set BA for sprite 0
+		// right and sprite is enabled, handle sprite y expansion, set BA for sprite 0 (6569)
 		case 55:
-			draw_graphics();
-			SampleBorder;
 			graphics_access();
 			DisplayIfBadLine;
 
@@ -1254,14 +2040,14 @@ static bool emulate_cycle_6569(void)
 					spr_exp_y ^= mask;
 			CheckSpriteDMA;
 
-			if (spr_dma_on & 0x01) {	// Don't remove these braces!
+			if (spr_ba_cycle<M>(0) == 55 && (spr_dma_on & 0x01)) {	// Don't remove these braces!
 				SetBALow;
 			} else
 				vic_ba_Low = false;
 			break;
 
 		// Turn on border in 38 column mode, turn on sprite DMA if Y coordinate is right and
-		// sprite is enabled, set BA for sprite 0, display window ends here
+		// sprite is enabled, set BA for sprite 0 (6569, 6567R56A), display window ends here
 		case 56:
 			if (!(ctrl2 & 8))
 				border_on = true;
@@ -1269,17 +2055,16 @@ static bool emulate_cycle_6569(void)
 			// Fourth sample of border state
 			border_on_sample[3] = border_on;
 
-			draw_graphics();
-			SampleBorder;
 			IdleAccess;
 			DisplayIfBadLine;
 			CheckSpriteDMA;
 
-			if (spr_dma_on & 0x01)
+			if (spr_ba_cycle<M>(0) <= 56 && (spr_dma_on & 0x01))
 				SetBALow;
 			break;
 
-		// Turn on border in 40 column mode, set BA for sprite 1, paint sprites
+		// Turn on border in 40 column mode, set BA for sprite 1 (6569) or 0 (6567R8),
+		// paint sprites
 		case 57:
 			if (ctrl2 & 8)
 				border_on = true;
@@ -1289,7 +2074,7 @@ static bool emulate_cycle_6569(void)
 
 			// Sample spr_disp_on and spr_data for sprite drawing
 			if ((spr_draw = spr_disp_on))
-				memcpy(spr_draw_data, spr_data, 8*4);
+				memcpy(line_rec->spr_data, spr_data, 8*4);
 
 			// Turn off sprite display if DMA is off
 			mask = 1;
@@ -1297,28 +2082,21 @@ static bool emulate_cycle_6569(void)
 				if ((spr_disp_on & mask) && !(spr_dma_on & mask))
 					spr_disp_on &= ~mask;
 
-			draw_background();
-			SampleBorder;
 			IdleAccess;
 			DisplayIfBadLine;
-			if (spr_dma_on & 0x02)
+			if (spr_dma_on & spr_ba_mask<M>(57))
 				SetBALow;
 			break;
 
-		// Fetch sprite pointer 0, mc_base->mc, turn on sprite display if necessary,
-		// turn off display if RC=7, read data of sprite 0
+		// mc_base->mc, turn on sprite display if necessary, turn off display if RC=7,
+		// fetch sprite pointer 0 (6569)
 		case 58:
-			draw_background();
-			SampleBorder;
-
 			mask = 1;
 			for (i=0; i<8; i++, mask<<=1) {
 				mc[i] = mc_base[i];
 				if ((spr_dma_on & mask) && (raster_y & 0xff) == my[i])
 					spr_disp_on |= mask;
 			}
-			SprPtrAccess(0);
-			SprDataAccess(0, 0);
 
 			if (rc == 7) {
 				vc_base = vc;
@@ -1328,93 +2106,56 @@ static bool emulate_cycle_6569(void)
 				display_state = true;
 				rc = (rc + 1) & 7;
 			}
+
+			sprite_cycle<M, 58>();
 			break;
 
-		// Set BA for sprite 2, read data of sprite 0
 		case 59:
-			draw_background();
-			SampleBorder;
-			SprDataAccess(0, 1);
-			SprDataAccess(0, 2);
-			DisplayIfBadLine;
-			if (spr_dma_on & 0x04)
-				SetBALow;
+			sprite_cycle<M, 59>();
 			break;
 
-		// Fetch sprite pointer 1, reset BA if sprite 1 and 2 off, graphics display ends here
+		// Graphics display ends here
 		case 60:
-			draw_background();
-			SampleBorder;
-
-			if (draw_this_line) {
-
-				// Draw sprites
-				if (spr_draw && SpritesOn)
-					draw_sprites();
-
-				// Draw border
-				if (border_on_sample[0])
-					for (i=0; i<4; i++)
-						memset8(chunky_line_start+i*8, border_color_sample[i]);
-				if (border_on_sample[1])
-					memset8(chunky_line_start+4*8, border_color_sample[4]);
-				if (border_on_sample[2])
-					for (i=5; i<43; i++)
-						memset8(chunky_line_start+i*8, border_color_sample[i]);
-				if (border_on_sample[3])
-					memset8(chunky_line_start+43*8, border_color_sample[43]);
-				if (border_on_sample[4])
-					for (i=44; i<DISPLAY_X/8; i++)
-						memset8(chunky_line_start+i*8, border_color_sample[i]);
-
-				// Increment pointer in chunky buffer
+			if (__atomic_load_n(&hud_visible, __ATOMIC_RELAXED)) {
+				uint64_t start = latency_now();
+				end_line<M>();
+				hud_vic_ns += latency_now() - start;
+			} else
+				end_line<M>();
+
+			// Increment pointer in chunky buffer
+			if (draw_this_line)
 				chunky_line_start += xmod;
-			}
 
-			SprPtrAccess(1);
-			SprDataAccess(1, 0);
-			DisplayIfBadLine;
-			if (!(spr_dma_on & 0x06))
-				vic_ba_Low = false;
+			sprite_cycle<M, 60>();
 			break;
 
-		// Set BA for sprite 3, read data of sprite 1
 		case 61:
-			SprDataAccess(1, 1);
-			SprDataAccess(1, 2);
-			DisplayIfBadLine;
-			if (spr_dma_on & 0x08)
-				SetBALow;
+			sprite_cycle<M, 61>();
 			break;
 
-		// Read sprite pointer 2, reset BA if sprite 2 and 3 off, read data of sprite 2
 		case 62:
-			SprPtrAccess(2);
-			SprDataAccess(2, 0);
-			DisplayIfBadLine;
-			if (!(spr_dma_on & 0x0c))
-				vic_ba_Low = false;
+			sprite_cycle<M, 62>();
 			break;
 
-		// Set BA for sprite 4, read data of sprite 2
+		// Last cycle (6569)
 		case 63:
-			SprDataAccess(2, 1);
-			SprDataAccess(2, 2);
-			DisplayIfBadLine;
-
-			if (raster_y == dy_stop)
-				ud_border_on = true;
-			else
-				if (ctrl1 & 0x10 && raster_y == dy_start)
-					ud_border_on = false;
+			sprite_cycle<M, 63>();
+			if (M::CYCLES_PER_LINE == 63)
+				return last_cycle();
+			break;
 
-			if (spr_dma_on & 0x10)
-				SetBALow;
+		// Last cycle (6567R56A)
+		case 64:
+			sprite_cycle<M, 64>();
+			if (M::CYCLES_PER_LINE == 64)
+				return last_cycle();
+			break;
 
-			// Last cycle
-			raster_x += 8;
-			cycle = 1;
-			return true;
+		// Last cycle (6567R8)
+		case 65:
+			sprite_cycle<M, 65>();
+			return last_cycle();
 	}
 
 	// Next cycle
@@ -4,15 +4,70 @@
  *  Frodo (C) 1994-1997,2002 Christian Bauer
  */
 
-// Total number of raster lines (PAL)
-const unsigned TOTAL_RASTERS = 0x138;
+// Timing of the VIC-II models. The emulation is specialised for each model
+// at compile time, the model of the C64 is selected at startup
+struct vic_6569					// PAL
+{
+	static const int CYCLES_PER_LINE = 63;
+	static const int TOTAL_RASTERS = 0x138;
+	static const unsigned SCREEN_FREQ = 50;		// Screen refresh frequency
+	static const unsigned MAINS_FREQ = 50;		// Mains frequency (TOD input)
+	static const uint32_t CLOCK_FREQ = 985248;	// CPU clock in Hz
+	static const int SPR0_CYCLE = 58;			// Sprite 0 pointer access
+	static const uint16_t SPR_FIRST_X = 0x194;	// Leftmost sprite X coordinate of a line
+	static const uint16_t SPR_X_WRAP = 0x1f8;	// Sprite X coordinates wrap here
+	static const int FIRST_DISP_LINE = 0x10;	// First and last displayed line
+	static const int LAST_DISP_LINE = 0x11f;
+};
 
-// Screen refresh frequency (PAL)
-const unsigned SCREEN_FREQ = 50;
+struct vic_6567r8				// NTSC
+{
+	static const int CYCLES_PER_LINE = 65;
+	static const int TOTAL_RASTERS = 0x107;
+	static const unsigned SCREEN_FREQ = 60;
+	static const unsigned MAINS_FREQ = 60;
+	static const uint32_t CLOCK_FREQ = 1022727;
+	static const int SPR0_CYCLE = 60;
+	static const uint16_t SPR_FIRST_X = 0x19c;
+	static const uint16_t SPR_X_WRAP = 0x200;
+	static const int FIRST_DISP_LINE = 0x10;
+	static const int LAST_DISP_LINE = 0x106;
+};
 
-static void reset6569();
+struct vic_6567r56a				// Old NTSC
+{
+	static const int CYCLES_PER_LINE = 64;
+	static const int TOTAL_RASTERS = 0x106;
+	static const unsigned SCREEN_FREQ = 60;
+	static const unsigned MAINS_FREQ = 60;
+	static const uint32_t CLOCK_FREQ = 1022727;
+	static const int SPR0_CYCLE = 59;
+	static const uint16_t SPR_FIRST_X = 0x19c;
+	static const uint16_t SPR_X_WRAP = 0x200;
+	static const int FIRST_DISP_LINE = 0x10;
+	static const int LAST_DISP_LINE = 0x105;
+};
 
-static bool emulate_cycle_6569(void);
+template <class M> static void reset6569();
+
+template <class M> static bool emulate_cycle_6569(void);
+static uint8_t read_register_6569(uint16_t adr, uint8_t data);
 static void write_register_6569(uint16_t adr, uint8_t byte);
 static void changed_va_6569(uint16_t new_va);	// CIA VA14/15 has changed
+static void changed_page_6569(uint8_t page);	// First write to a RAM page in this frame
+static void changed_color_ram_6569(void);		// Color RAM has changed
+
+// VIC-relevant changes during a frame
+enum {
+	VIC_CHANGED_MATRIX = 0x01,		// Video matrix (including sprite pointers)
+	VIC_CHANGED_CHARSET = 0x02,		// Character generator in RAM
+	VIC_CHANGED_BITMAP = 0x04,		// Bitmap
+	VIC_CHANGED_SPRITES = 0x08,		// Data of enabled sprites
+	VIC_CHANGED_COLOR = 0x10,		// Color RAM
+	VIC_CHANGED_IDLE = 0x20,		// Idle state graphics ($3fff/$39ff)
+	VIC_CHANGED_REGS = 0x40			// VIC registers or CIA VA14/15
+};
+
+static uint8_t vic_frame_changes(void);		// VIC_CHANGED_* flags of the last complete frame
+static bool vic_frame_unchanged(void);		// Last frame is identical to the one before
 
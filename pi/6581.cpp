@@ -11,6 +11,13 @@
 
 #include <math.h>
 
+// Synthesis kernels, selected by the instruction set the emulator is built for
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 
 /*
  *  Resonance frequency polynomials
@@ -28,6 +35,7 @@
 				- 0.000880196 * f * f * f)
 
 
+#ifndef HEADLESS
 /*
  *  Random number generator for noise waveform
  */
@@ -39,14 +47,24 @@ static uint8_t sid_random(void)
 	seed = seed * 1103515245 + 12345;
 	return seed >> 16;
 }
+#endif
 
 
 /*
  *  Constructor
  */
 
-static void init6581()
+template <class M> static void init6581()
 {
+	// Timing of the model
+	uint32_t sid_cycles = M::CLOCK_FREQ / SAMPLE_FREQ;	// # of SID clocks per sample frame
+	sid_freq = M::CLOCK_FREQ;
+	sid_frame_cycles = M::CYCLES_PER_LINE * M::TOTAL_RASTERS;
+	for (int i=0; i<16; i++)
+		EGTable[i] = (sid_cycles << 16) / EGDivisors[i];
+	for (int i=0; i<256; i++)
+		EGDRFloor[i] = (i && EGDRShift[i-1] == EGDRShift[i]) ? EGDRFloor[i-1] : i;
+
 	// Link voices together
 	voice[0].mod_by = &voice[2];
 	voice[1].mod_by = &voice[0];
@@ -79,7 +97,20 @@ static void reset6581(void)
 		regs[i] = 0;
 	last_sid_byte = 0;
 
-	// Reset the renderer
+	// The audio thread owns the renderer once it is running
+	if (ready)
+		push_event_6581(SID_EVENT_RESET, 0);
+	else
+		reset_renderer_6581();
+}
+
+
+/*
+ *  Reset the renderer
+ */
+
+static void reset_renderer_6581(void)
+{
 	volume = 0;
 	v3_mute = false;
 
@@ -99,9 +130,6 @@ static void reset6581(void)
 	f_ampl = 1.0;
 	d1 = d2 = g1 = g2 = 0.0;
 	xn1 = xn2 = yn1 = yn2 = 0.0;
-
-	sample_in_ptr = 0;
-	memset(sample_buf, 0, SAMPLE_BUF_SIZE);
 }
 
 #if 0
@@ -148,12 +176,62 @@ static void get_state_6581(MOS6581State *ss)
 #endif
 
 /*
- * Fill buffer (for Unix sound routines), sample volume (for sampled voice)
+ *  Queue a register write for the audio thread, stamped with the current
+ *  cycle. It is published with the line at emulate_line_6581()
+ */
+
+inline static bool queue_event_6581(uint8_t adr, uint8_t byte)
+{
+	if (sid_queue_in_local - __atomic_load_n(&sid_queue_out, __ATOMIC_ACQUIRE) == SID_QUEUE_SIZE)
+		return false;
+
+	sid_event *e = &sid_queue[sid_queue_in_local % SID_QUEUE_SIZE];
+	e->cycle = cycle_counter;
+	e->adr = adr;
+	e->byte = byte;
+	sid_queue_in_local++;
+	return true;
+}
+
+
+/*
+ *  Reload the renderer after lost writes: reset it and write all registers
+ *  from regs[] again, once the queue has room for that
+ */
+
+static bool resync_6581(void)
+{
+	if (SID_QUEUE_SIZE - (sid_queue_in_local - __atomic_load_n(&sid_queue_out, __ATOMIC_ACQUIRE)) < 26)
+		return false;
+
+	queue_event_6581(SID_EVENT_RESET, 0);
+	for (int i=0; i<25; i++)
+		queue_event_6581(i, regs[i]);
+	sid_queue_resync = false;
+	return true;
+}
+
+inline static void push_event_6581(uint8_t adr, uint8_t byte)
+{
+	// regs[] already has the write, the reload covers it
+	if (sid_queue_resync ? !resync_6581() : !queue_event_6581(adr, byte)) {
+		sid_queue_dropped++;
+		sid_queue_resync = true;
+	}
+}
+
+
+/*
+ *  Publish the register writes of the line, the audio thread renders up
+ *  to this cycle. A pending reload is queued here too if no write comes
  */
 
 inline static void emulate_line_6581(void)
 {
-	emulate_line_sound();
+	if (sid_queue_resync)
+		resync_6581();
+	__atomic_store_n(&sid_queue_in, sid_queue_in_local, __ATOMIC_RELEASE);
+	__atomic_store_n(&sid_queue_cycle, cycle_counter, __ATOMIC_RELEASE);
 }
 
 
@@ -189,8 +267,21 @@ inline static void write_register_6581(uint16_t adr, uint8_t byte)
 	// Keep a local copy of the register values
 	last_sid_byte = regs[adr] = byte;
 
-	if (!ready)
+	if (ready)
+		push_event_6581(adr, byte);
+}
+
+
+/*
+ *  Apply a register write to the renderer, called by the audio thread
+ */
+
+inline static void apply_register_6581(uint8_t adr, uint8_t byte)
+{
+	if (adr == SID_EVENT_RESET) {
+		reset_renderer_6581();
 		return;
+	}
 
 	int v = adr/7;	// Voice number
 
@@ -199,14 +290,14 @@ inline static void write_register_6581(uint16_t adr, uint8_t byte)
 		case 7:
 		case 14:
 			voice[v].freq = (voice[v].freq & 0xff00) | byte;
-			voice[v].add = (uint32_t)((float)voice[v].freq * SID_FREQ / SAMPLE_FREQ);
+			voice[v].add = (uint32_t)((float)voice[v].freq * sid_freq / SAMPLE_FREQ);
 			break;
 
 		case 1:
 		case 8:
 		case 15:
 			voice[v].freq = (voice[v].freq & 0xff) | (byte << 8);
-			voice[v].add = (uint32_t)((float)voice[v].freq * SID_FREQ / SAMPLE_FREQ);
+			voice[v].add = (uint32_t)((float)voice[v].freq * sid_freq / SAMPLE_FREQ);
 			break;
 
 		case 2:
@@ -369,71 +460,244 @@ static void calc_filter(void)
 }
 
 
+#ifndef HEADLESS
 /*
- *  Fill one audio buffer with calculated SID sound
+ *  Block synthesis kernels, they work on 8 samples at a time (the block
+ *  buffers are padded to a multiple of 8)
  */
 
-static void calc_buffer(int16_t *buf, long count)
+// Sample as the signed value mixed into the output
+inline static int16_t sid_signed(uint16_t output)
 {
-	// Get filter coefficients, so the emulator won't change
-	// them in the middle of our calculations
-	float cf_ampl = f_ampl;
-	float cd1 = d1, cd2 = d2, cg1 = g1, cg2 = g2;
+	return (int16_t)(output ^ 0x8000);
+}
 
-	// Index in sample_buf for reading, 16.16 fixed
-	uint32_t sample_count = (sample_in_ptr + SAMPLE_BUF_SIZE/2) << 16;
+#if defined(__SSE2__)
 
-	count >>= 1;	// 16 bit mono output, count is in bytes
+// count[i] = (c + (i+1)*add) & 0xffffff
+static void ramp_6581(uint32_t *count, uint32_t c, uint32_t add, int n)
+{
+	__m128i v = _mm_add_epi32(_mm_set1_epi32(c), _mm_setr_epi32(add, 2*add, 3*add, 4*add));
+	__m128i inc = _mm_set1_epi32(4*add);
+	__m128i mask = _mm_set1_epi32(0xffffff);
+
+	for (int i=0; i<n; i+=4) {
+		_mm_storeu_si128((__m128i *)(count + i), _mm_and_si128(v, mask));
+		v = _mm_add_epi32(v, inc);
+	}
+}
+
+// Sawtooth, the upper 16 bits of the counter
+static void saw_6581(int16_t *out, const uint32_t *count, int n)
+{
+	__m128i bias = _mm_set1_epi32(0x8000);
+
+	for (int i=0; i<n; i+=8) {
+		__m128i lo = _mm_sub_epi32(_mm_srli_epi32(_mm_loadu_si128((const __m128i *)(count + i)), 8), bias);
+		__m128i hi = _mm_sub_epi32(_mm_srli_epi32(_mm_loadu_si128((const __m128i *)(count + i + 4)), 8), bias);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+	}
+}
+
+// Pulse, the counter and pw are below 2^24 so the signed compare works
+static void rect_6581(int16_t *out, const uint32_t *count, uint32_t pw, int n)
+{
+	__m128i p = _mm_set1_epi32(pw);
+	__m128i sign = _mm_set1_epi16((int16_t)0x8000);
+
+	for (int i=0; i<n; i+=8) {
+		__m128i lo = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(count + i)), p);
+		__m128i hi = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(count + i + 4)), p);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_packs_epi32(lo, hi), sign));
+	}
+}
+
+// env[i] = ((level + (i+1)*delta) * vol[i]) >> 20, the product is below 2^28
+static void eg_ramp_6581(int16_t *env, const uint8_t *vol, uint32_t level, uint32_t delta, int n)
+{
+	__m128i l = _mm_add_epi32(_mm_set1_epi32(level), _mm_setr_epi32(delta, 2*delta, 3*delta, 4*delta));
+	__m128i inc = _mm_set1_epi32(4*delta);
+	__m128i zero = _mm_setzero_si128();
+
+	for (int i=0; i<n; i+=8) {
+		__m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(vol + i)), zero);
+		__m128i e[2];
+		for (int k=0; k<2; k++) {
+			// Multiply the even and odd lanes, SSE2 has no 32 bit multiply
+			__m128i vk = k ? _mm_unpackhi_epi16(v, zero) : _mm_unpacklo_epi16(v, zero);
+			__m128i even = _mm_mul_epu32(l, vk);
+			__m128i odd = _mm_mul_epu32(_mm_srli_epi64(l, 32), _mm_srli_epi64(vk, 32));
+			__m128i p = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+			e[k] = _mm_srli_epi32(p, 20);
+			l = _mm_add_epi32(l, inc);
+		}
+		_mm_storeu_si128((__m128i *)(env + i), _mm_packs_epi32(e[0], e[1]));
+	}
+}
+
+// sum[i] += out[i] * env[i]
+static void mix_6581(int32_t *sum, const int16_t *out, const int16_t *env, int n)
+{
+	for (int i=0; i<n; i+=8) {
+		__m128i o = _mm_loadu_si128((const __m128i *)(out + i));
+		__m128i e = _mm_loadu_si128((const __m128i *)(env + i));
+		__m128i lo = _mm_mullo_epi16(o, e);
+		__m128i hi = _mm_mulhi_epi16(o, e);
+		__m128i *s = (__m128i *)(sum + i);
+		_mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(lo, hi)));
+		_mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(lo, hi)));
+	}
+}
+
+#elif defined(__ARM_NEON)
+
+static void ramp_6581(uint32_t *count, uint32_t c, uint32_t add, int n)
+{
+	const uint32_t steps[4] = {add, 2*add, 3*add, 4*add};
+	uint32x4_t v = vaddq_u32(vdupq_n_u32(c), vld1q_u32(steps));
+	uint32x4_t inc = vdupq_n_u32(4*add);
+	uint32x4_t mask = vdupq_n_u32(0xffffff);
+
+	for (int i=0; i<n; i+=4) {
+		vst1q_u32(count + i, vandq_u32(v, mask));
+		v = vaddq_u32(v, inc);
+	}
+}
+
+static void saw_6581(int16_t *out, const uint32_t *count, int n)
+{
+	uint16x8_t sign = vdupq_n_u16(0x8000);
+
+	for (int i=0; i<n; i+=8) {
+		uint16x8_t v = vcombine_u16(vshrn_n_u32(vld1q_u32(count + i), 8), vshrn_n_u32(vld1q_u32(count + i + 4), 8));
+		vst1q_s16(out + i, vreinterpretq_s16_u16(veorq_u16(v, sign)));
+	}
+}
+
+static void rect_6581(int16_t *out, const uint32_t *count, uint32_t pw, int n)
+{
+	uint32x4_t p = vdupq_n_u32(pw);
+	uint16x8_t sign = vdupq_n_u16(0x8000);
+
+	for (int i=0; i<n; i+=8) {
+		uint16x8_t m = vcombine_u16(vmovn_u32(vcgtq_u32(vld1q_u32(count + i), p)), vmovn_u32(vcgtq_u32(vld1q_u32(count + i + 4), p)));
+		vst1q_s16(out + i, vreinterpretq_s16_u16(veorq_u16(m, sign)));
+	}
+}
+
+static void eg_ramp_6581(int16_t *env, const uint8_t *vol, uint32_t level, uint32_t delta, int n)
+{
+	const uint32_t steps[4] = {delta, 2*delta, 3*delta, 4*delta};
+	uint32x4_t l = vaddq_u32(vdupq_n_u32(level), vld1q_u32(steps));
+	uint32x4_t inc = vdupq_n_u32(4*delta);
+
+	for (int i=0; i<n; i+=8) {
+		uint16x8_t v = vmovl_u8(vld1_u8(vol + i));
+		uint32x4_t e0 = vshrq_n_u32(vmulq_u32(l, vmovl_u16(vget_low_u16(v))), 20);
+		l = vaddq_u32(l, inc);
+		uint32x4_t e1 = vshrq_n_u32(vmulq_u32(l, vmovl_u16(vget_high_u16(v))), 20);
+		l = vaddq_u32(l, inc);
+		vst1q_s16(env + i, vreinterpretq_s16_u16(vcombine_u16(vmovn_u32(e0), vmovn_u32(e1))));
+	}
+}
+
+static void mix_6581(int32_t *sum, const int16_t *out, const int16_t *env, int n)
+{
+	for (int i=0; i<n; i+=8) {
+		int16x8_t o = vld1q_s16(out + i);
+		int16x8_t e = vld1q_s16(env + i);
+		vst1q_s32(sum + i, vmlal_s16(vld1q_s32(sum + i), vget_low_s16(o), vget_low_s16(e)));
+		vst1q_s32(sum + i + 4, vmlal_s16(vld1q_s32(sum + i + 4), vget_high_s16(o), vget_high_s16(e)));
+	}
+}
+
+#else
+
+static void ramp_6581(uint32_t *count, uint32_t c, uint32_t add, int n)
+{
+	for (int i=0; i<n; i++)
+		count[i] = (c + (i+1)*add) & 0xffffff;
+}
+
+static void saw_6581(int16_t *out, const uint32_t *count, int n)
+{
+	for (int i=0; i<n; i++)
+		out[i] = sid_signed(count[i] >> 8);
+}
+
+static void rect_6581(int16_t *out, const uint32_t *count, uint32_t pw, int n)
+{
+	for (int i=0; i<n; i++)
+		out[i] = sid_signed(count[i] > pw ? 0xffff : 0);
+}
+
+static void eg_ramp_6581(int16_t *env, const uint8_t *vol, uint32_t level, uint32_t delta, int n)
+{
+	for (int i=0; i<n; i++)
+		env[i] = ((level + (i+1)*delta) * vol[i]) >> 20;
+}
 
-	while (count--) {
-		int32_t sum_output;
-		int32_t sum_output_filter = 0;
+static void mix_6581(int32_t *sum, const int16_t *out, const int16_t *env, int n)
+{
+	for (int i=0; i<n; i++)
+		sum[i] += out[i] * env[i];
+}
+
+#endif
+
+
+/*
+ *  Block synthesis. Register writes only take effect between blocks, so
+ *  within a block each voice runs on its own, a stage at a time
+ */
+
+static const int SID_BLOCK = 64;		// Longest block in samples (multiple of 8)
 
-		// Get current master volume from sample buffer,
-		// calculate sampled voice
-		uint8_t master_volume = sample_buf[(sample_count >> 16) % SAMPLE_BUF_SIZE];
-		sample_count += ((0x138 * 50) << 16) / SAMPLE_FREQ;
-		sum_output = SampleTab[master_volume] << 8;
+// Block buffers, only used by the audio thread
+static uint32_t osc_count[3][SID_BLOCK+8];	// Counter before the block, then after each sample
+static int16_t osc_out[3][SID_BLOCK];	// Waveform output
+static int16_t eg_out[SID_BLOCK+8];	// Envelope output
+static uint8_t block_volume[SID_BLOCK+8];	// Master volume of each sample
+static int32_t mix_out[SID_BLOCK];		// Sum of the unfiltered voices
+static int32_t mix_filter[SID_BLOCK];	// Sum of the filtered voices
 
-		// Loop for all three voices
+
+/*
+ *  Oscillators. A voice synced by another one and the noise voices (they
+ *  share the random generator) step sample by sample in voice order like
+ *  the hardware. The others are a ramp
+ */
+
+static void oscillators_6581(int n)
+{
+	bool step[3];
+	bool any_step = false;
+
+	for (int j=0; j<3; j++) {
+		DRVoice *v = &voice[j];
+		osc_count[j][0] = v->count;
+		step[j] = v->wave == WAVE_NOISE || v->mod_by->sync;
+		any_step |= step[j];
+
+		if (!step[j]) {
+			ramp_6581(osc_count[j] + 1, v->count, v->test ? 0 : v->add, n);
+			v->count = osc_count[j][n];
+		}
+	}
+
+	if (!any_step)
+		return;
+
+	for (int i=1; i<=n; i++) {
 		for (int j=0; j<3; j++) {
 			DRVoice *v = &voice[j];
 
-			// Envelope generators
-			uint16_t envelope;
-
-			switch (v->eg_state) {
-				case EG_ATTACK:
-					v->eg_level += v->a_add;
-					if (v->eg_level > 0xffffff) {
-						v->eg_level = 0xffffff;
-						v->eg_state = EG_DECAY;
-					}
-					break;
-				case EG_DECAY:
-					if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
-						v->eg_level = v->s_level;
-					else {
-						v->eg_level -= v->d_sub >> EGDRShift[v->eg_level >> 16];
-						if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
-							v->eg_level = v->s_level;
-					}
-					break;
-				case EG_RELEASE:
-					v->eg_level -= v->r_sub >> EGDRShift[v->eg_level >> 16];
-					if (v->eg_level > 0xffffff) {
-						v->eg_level = 0;
-						v->eg_state = EG_IDLE;
-					}
-					break;
-				case EG_IDLE:
-					v->eg_level = 0;
-					break;
+			if (!step[j]) {
+				// Only its sync is left to do
+				if (v->sync && !v->test && osc_count[j][i-1] + v->add > 0x1000000)
+					v->mod_to->count = 0;
+				continue;
 			}
-			envelope = (v->eg_level * master_volume) >> 20;
-
-			// Waveform generator
-			uint16_t output;
 
 			if (!v->test)
 				v->count += v->add;
@@ -443,61 +707,226 @@ static void calc_buffer(int16_t *buf, long count)
 
 			v->count &= 0xffffff;
 
-			switch (v->wave) {
-				case WAVE_TRI:
-					if (v->ring)
-						output = TriTable[(v->count ^ (v->mod_by->count & 0x800000)) >> 11];
-					else
-						output = TriTable[v->count >> 11];
-					break;
-				case WAVE_SAW:
-					output = v->count >> 8;
-					break;
-				case WAVE_RECT:
-					if (v->count > (uint32_t)(v->pw << 12))
-						output = 0xffff;
-					else
-						output = 0;
-					break;
-				case WAVE_TRISAW:
-					output = TriSawTable[v->count >> 16];
-					break;
-				case WAVE_TRIRECT:
-					if (v->count > (uint32_t)(v->pw << 12))
-						output = TriRectTable[v->count >> 16];
-					else
-						output = 0;
-					break;
-				case WAVE_SAWRECT:
-					if (v->count > (uint32_t)(v->pw << 12))
-						output = SawRectTable[v->count >> 16];
-					else
-						output = 0;
-					break;
-				case WAVE_TRISAWRECT:
-					if (v->count > (uint32_t)(v->pw << 12))
-						output = TriSawRectTable[v->count >> 16];
-					else
-						output = 0;
-					break;
-				case WAVE_NOISE:
-					if (v->count > 0x100000) {
-						output = v->noise = sid_random() << 8;
-						v->count &= 0xfffff;
-					} else
-						output = v->noise;
-					break;
-				default:
-					output = 0x8000;
-					break;
+			if (v->wave == WAVE_NOISE) {
+				if (v->count > 0x100000) {
+					v->noise = sid_random() << 8;
+					v->count &= 0xfffff;
+				}
+				osc_out[j][i-1] = sid_signed(v->noise);
 			}
-			if (v->filter)
-				sum_output_filter += (int16_t)(output ^ 0x8000) * envelope;
-			else
-				sum_output += (int16_t)(output ^ 0x8000) * envelope;
+			osc_count[j][i] = v->count;
 		}
+	}
+}
+
+
+/*
+ *  Envelope generator of a voice for one sample
+ */
+
+inline static void eg_step_6581(DRVoice *v)
+{
+	switch (v->eg_state) {
+		case EG_ATTACK:
+			v->eg_level += v->a_add;
+			if (v->eg_level > 0xffffff) {
+				v->eg_level = 0xffffff;
+				v->eg_state = EG_DECAY;
+			}
+			break;
+		case EG_DECAY:
+			if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
+				v->eg_level = v->s_level;
+			else {
+				v->eg_level -= v->d_sub >> EGDRShift[v->eg_level >> 16];
+				if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
+					v->eg_level = v->s_level;
+			}
+			break;
+		case EG_RELEASE:
+			v->eg_level -= v->r_sub >> EGDRShift[v->eg_level >> 16];
+			if (v->eg_level > 0xffffff) {
+				v->eg_level = 0;
+				v->eg_state = EG_IDLE;
+			}
+			break;
+		case EG_IDLE:
+			v->eg_level = 0;
+			break;
+	}
+}
+
+
+/*
+ *  Envelope generator of a voice for a block, returns false if it is
+ *  silent for the whole block (eg_out isn't written then)
+ */
+
+static bool envelope_6581(DRVoice *v, int n)
+{
+	if (v->eg_state == EG_IDLE) {
+		v->eg_level = 0;
+		return false;
+	}
+
+	// While the level stays within a range of the same decay/release shift
+	// (and doesn't reach the top, sustain or 0), it changes by the same
+	// amount each sample. The samples in between step one at a time
+	for (int i=0; i<n;) {
+		uint32_t level = v->eg_level;
+		uint32_t bottom = EGDRFloor[level >> 16] << 16;
+		uint32_t delta = 0;
+		uint32_t run = n - i;
+		uint32_t sub, last;		// Decrement per sample, samples until sustain or 0
+
+		switch (v->eg_state) {
+			case EG_ATTACK:
+				if (v->a_add) {
+					delta = v->a_add;
+					if ((0xffffff - level) / delta < run)
+						run = (0xffffff - level) / delta;
+				}
+				break;
+			case EG_DECAY:
+				if (level <= v->s_level)
+					v->eg_level = level = v->s_level;
+				else if ((sub = v->d_sub >> EGDRShift[level >> 16])) {
+					delta = -sub;
+					last = (level - v->s_level) / sub;
+					if ((level - bottom) / sub + 1 < run)
+						run = (level - bottom) / sub + 1;
+					if (last < run)
+						run = last;
+				}
+				break;
+			case EG_RELEASE:
+				if ((sub = v->r_sub >> EGDRShift[level >> 16])) {
+					delta = -sub;
+					last = level / sub;
+					if ((level - bottom) / sub + 1 < run)
+						run = (level - bottom) / sub + 1;
+					if (last < run)
+						run = last;
+				}
+				break;
+			case EG_IDLE:
+				v->eg_level = level = 0;
+				break;
+		}
+
+		if (run) {
+			eg_ramp_6581(eg_out + i, block_volume + i, level, delta, run);
+			v->eg_level = level + run * delta;
+			i += run;
+		} else {
+			eg_step_6581(v);
+			eg_out[i] = (v->eg_level * block_volume[i]) >> 20;
+			i++;
+		}
+	}
+
+	int16_t audible = 0;
+	for (int i=0; i<n; i++)
+		audible |= eg_out[i];
+	return audible != 0;
+}
+
+
+/*
+ *  Waveform generator of voice j from the counters, returns false if the
+ *  output is 0 for the whole block (osc_out isn't written then)
+ */
+
+static bool waveform_6581(int j, int n)
+{
+	const DRVoice *v = &voice[j];
+	const uint32_t *count = osc_count[j] + 1;
+	int16_t *out = osc_out[j];
+	uint32_t pw = v->pw << 12;
+
+	switch (v->wave) {
+		case WAVE_TRI:
+			if (v->ring) {
+				// Voice 1 is modulated by voice 3 of the previous sample,
+				// the others by the voice before in the same sample
+				const uint32_t *mod = j == 0 ? osc_count[2] : osc_count[j-1] + 1;
+				for (int i=0; i<n; i++)
+					out[i] = sid_signed(TriTable[(count[i] ^ (mod[i] & 0x800000)) >> 11]);
+			} else {
+				for (int i=0; i<n; i++)
+					out[i] = sid_signed(TriTable[count[i] >> 11]);
+			}
+			return true;
+		case WAVE_SAW:
+			saw_6581(out, count, n);
+			return true;
+		case WAVE_RECT:
+			rect_6581(out, count, pw, n);
+			return true;
+		case WAVE_TRISAW:
+			for (int i=0; i<n; i++)
+				out[i] = sid_signed(TriSawTable[count[i] >> 16]);
+			return true;
+		case WAVE_TRIRECT:
+			for (int i=0; i<n; i++)
+				out[i] = sid_signed(count[i] > pw ? TriRectTable[count[i] >> 16] : 0);
+			return true;
+		case WAVE_SAWRECT:
+			for (int i=0; i<n; i++)
+				out[i] = sid_signed(count[i] > pw ? SawRectTable[count[i] >> 16] : 0);
+			return true;
+		case WAVE_TRISAWRECT:
+			for (int i=0; i<n; i++)
+				out[i] = sid_signed(count[i] > pw ? TriSawRectTable[count[i] >> 16] : 0);
+			return true;
+		case WAVE_NOISE:
+			// Written by the oscillator
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/*
+ *  Calculate a block of n samples
+ */
+
+static void calc_block(int16_t *buf, int n)
+{
+	int rounded = (n + 7) & ~7;		// The kernels work on 8 samples
+
+	// Sampled voice
+	for (int i=0; i<rounded; i++) {
+		mix_out[i] = SampleTab[block_volume[i]] << 8;
+		mix_filter[i] = 0;
+	}
+
+	oscillators_6581(n);
+	for (int j=0; j<3; j++) {
+		DRVoice *v = &voice[j];
+		if (envelope_6581(v, n) && waveform_6581(j, n))
+			mix_6581(v->filter ? mix_filter : mix_out, osc_out[j], eg_out, rounded);
+	}
+
+	// Filter
+	float cf_ampl = f_ampl;
+	float cd1 = d1, cd2 = d2, cg1 = g1, cg2 = g2;
+
+	if (SIDFilters && cd1 == 0.0 && cd2 == 0.0 && cg1 == 0.0 && cg2 == 0.0) {
+		// No filter type or all of them, each sample only depends on its
+		// input. The state is needed for the next block
+		for (int i=0; i<n; i++)
+			buf[i] = (mix_out[i] + (int32_t)((float)mix_filter[i] * cf_ampl)) >> 10;
+		xn2 = n > 1 ? (float)mix_filter[n-2] * cf_ampl : xn1;
+		xn1 = (float)mix_filter[n-1] * cf_ampl;
+		yn2 = xn2; yn1 = xn1;
+		return;
+	}
+
+	for (int i=0; i<n; i++) {
+		int32_t sum_output_filter = mix_filter[i];
 
-		// Filter
 		if (SIDFilters) {
 			float xn = (float)sum_output_filter * cf_ampl;
 			float yn = xn + cd1 * xn1 + cd2 * xn2 - cg1 * yn1 - cg2 * yn2;
@@ -506,7 +935,90 @@ static void calc_buffer(int16_t *buf, long count)
 		}
 
 		// Write to buffer
-		*buf++ = (sum_output + sum_output_filter) >> 10;
+		buf[i] = (mix_out[i] + sum_output_filter) >> 10;
 	}
 }
 
+
+/*
+ *  Flag: A register write is to be applied at the sample of this cycle.
+ *  A write far after the last line published is from before a reset
+ */
+
+inline static bool event_due(const sid_event *e, uint32_t sample_cycle, uint32_t end)
+{
+	return (int32_t)(e->cycle - sample_cycle) <= 0 || (int32_t)(e->cycle - end) > (int32_t)sid_frame_cycles;
+}
+
+
+/*
+ *  Fill one audio buffer with calculated SID sound
+ */
+
+static void calc_buffer(int16_t *buf, long count)
+{
+	count >>= 1;	// 16 bit mono output, count is in bytes
+	if (count == 0)
+		return;
+
+	// The cycle is read first, so all writes up to it are in the queue
+	uint32_t end = __atomic_load_n(&sid_queue_cycle, __ATOMIC_ACQUIRE);
+	uint32_t in = __atomic_load_n(&sid_queue_in, __ATOMIC_ACQUIRE);
+	uint32_t out = sid_queue_out;
+
+	// The buffer spans the cycles from the last one up to the last line
+	// published, so the emulator and the audio clock can't drift apart.
+	// Start over a frame behind after a stall or a reset
+	int32_t span = end - (uint32_t)(sid_audio_pos >> 16);
+	if (span < 0 || span > 4 * (int32_t)sid_frame_cycles) {
+		sid_audio_pos = (uint64_t)(uint32_t)(end - sid_frame_cycles) << 16;
+		span = sid_frame_cycles;
+	}
+	uint64_t step = ((uint64_t)span << 16) / count;
+
+	while (count > 0) {
+		// Apply the register writes up to the cycle of the first sample
+		while (out != in && event_due(&sid_queue[out % SID_QUEUE_SIZE], sid_audio_pos >> 16, end)) {
+			const sid_event *e = &sid_queue[out % SID_QUEUE_SIZE];
+			apply_register_6581(e->adr, e->byte);
+			out++;
+		}
+
+		// Volume writes (sampled voices) are applied within the block,
+		// it ends at the sample of any other write
+		int n = 0;
+		int max_n = count < SID_BLOCK ? count : SID_BLOCK;
+		for (;;) {
+			int start = n;
+			if (out == in) {
+				sid_audio_pos += (max_n - n) * step;
+				n = max_n;
+			} else {
+				const sid_event *e = &sid_queue[out % SID_QUEUE_SIZE];
+				do {
+					sid_audio_pos += step;
+					n++;
+				} while (n < max_n && !event_due(e, sid_audio_pos >> 16, end));
+			}
+			memset(block_volume + start, volume, n - start);
+			if (n == max_n)
+				break;
+
+			const sid_event *e;
+			while (out != in && event_due(e = &sid_queue[out % SID_QUEUE_SIZE], sid_audio_pos >> 16, end) &&
+				e->adr == 24 && ((e->byte >> 4) & 7) == f_type) {
+				apply_register_6581(e->adr, e->byte);
+				out++;
+			}
+			if (out != in && event_due(&sid_queue[out % SID_QUEUE_SIZE], sid_audio_pos >> 16, end))
+				break;
+		}
+
+		calc_block(buf, n);
+		buf += n;
+		count -= n;
+	}
+
+	__atomic_store_n(&sid_queue_out, out, __ATOMIC_RELEASE);
+}
+#endif
@@ -9,10 +9,7 @@
 #undef EMUL_MOS8580
 
 static const uint32_t SAMPLE_FREQ = 44100; // Sample output frequency in Hz
-static const uint32_t SID_FREQ = 985248;   // SID frequency in Hz
-static const uint32_t CALC_FREQ = 50;      // Frequency at which calc_buffer is called in Hz (should be 50Hz)
-static const uint32_t SID_CYCLES = SID_FREQ/SAMPLE_FREQ; // # of SID clocks per sample frame
-static const int SAMPLE_BUF_SIZE = 0x138*2;// Size of buffer for sampled voice (double buffered)
+static const uint32_t SID_QUEUE_SIZE = 4096;	// Register writes on the way to the audio thread (power of 2)
 
 static const bool SIDFilters = true;		// Emulate SID filters
 
@@ -132,21 +129,47 @@ static float f_ampl;					// IIR filter input attenuation
 static float d1, d2, g1, g2;			// IIR filter coefficients
 static float xn1, xn2, yn1, yn2;		// IIR filter previous input/output signal
 
-static uint8_t sample_buf[SAMPLE_BUF_SIZE]; // Buffer for sampled voice
-static int sample_in_ptr;				// Index in sample_buf for writing
+static uint32_t sid_freq;				// SID frequency in Hz (of the model)
+static uint32_t sid_frame_cycles;		// Cycles per frame (of the model)
+
+// Register write, applied by the audio thread at the sample of its cycle
+struct sid_event {
+	uint32_t cycle;
+	uint8_t adr;			// Register, or SID_EVENT_RESET
+	uint8_t byte;
+};
+
+static const uint8_t SID_EVENT_RESET = 0xff;	// Reset the renderer
+
+// Single producer (emulation), single consumer (audio callback) queue
+static sid_event sid_queue[SID_QUEUE_SIZE];
+static uint32_t sid_queue_in;			// Events written, published once per line
+static uint32_t sid_queue_in_local;		// Events written, not published yet
+static uint32_t sid_queue_out;			// Events applied by the audio thread
+static uint32_t sid_queue_cycle;		// Cycle of the last published line
+static uint32_t sid_queue_dropped;		// Events lost because the queue was full
+static bool sid_queue_resync;			// Flag: Events were lost, the renderer must be reloaded from regs[]
+#ifndef HEADLESS
+static uint64_t sid_audio_pos;			// Cycle of the next sample, 32.16 fixed
+#endif
 
 static uint8_t regs[32];				// Copies of the 25 write-only SID registers
 static uint8_t last_sid_byte;			// Last value written to SID
 
-static void init6581();
+template <class M> static void init6581();
 static void reset6581(void);
 
 static uint8_t read_register_6581(uint16_t adr);
 static void write_register_6581(uint16_t adr, uint8_t byte);
 static void emulate_line_6581(void);
 
+static void push_event_6581(uint8_t adr, uint8_t byte);
+static void reset_renderer_6581(void);
+static void apply_register_6581(uint8_t adr, uint8_t byte);
 static void calc_filter(void);
+#ifndef HEADLESS
 static void calc_buffer(int16_t *buf, long count);
+#endif
 
 
 static uint16_t TriTable[0x1000*2];
@@ -435,17 +458,14 @@ static const uint16_t TriSawRectTable[0x100] = {
 };
 #endif
 
-static const uint32_t EGTable[16] = {
-	(SID_CYCLES << 16) / 9, (SID_CYCLES << 16) / 32,
-	(SID_CYCLES << 16) / 63, (SID_CYCLES << 16) / 95,
-	(SID_CYCLES << 16) / 149, (SID_CYCLES << 16) / 220,
-	(SID_CYCLES << 16) / 267, (SID_CYCLES << 16) / 313,
-	(SID_CYCLES << 16) / 392, (SID_CYCLES << 16) / 977,
-	(SID_CYCLES << 16) / 1954, (SID_CYCLES << 16) / 3126,
-	(SID_CYCLES << 16) / 3906, (SID_CYCLES << 16) / 11720,
-	(SID_CYCLES << 16) / 19531, (SID_CYCLES << 16) / 31251
+// EG table divisors, the table is calculated for the SID frequency of the model
+static const uint32_t EGDivisors[16] = {
+	9, 32, 63, 95, 149, 220, 267, 313,
+	392, 977, 1954, 3126, 3906, 11720, 19531, 31251
 };
 
+static uint32_t EGTable[16];
+
 static const uint8_t EGDRShift[256] = {
 	5,5,5,5,5,5,5,5,4,4,4,4,4,4,4,4,
 	3,3,3,3,3,3,3,3,3,3,3,3,2,2,2,2,
@@ -465,6 +485,8 @@ static const uint8_t EGDRShift[256] = {
 	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
 };
 
+static uint8_t EGDRFloor[256];		// Lowest EG level (upper 8 bits) with the same shift
+
 static const int16_t SampleTab[16] = {
 	(int16_t)0x8000, (int16_t)0x9111, (int16_t)0xa222, (int16_t)0xb333,
 	(int16_t)0xc444, (int16_t)0xd555, (int16_t)0xe666, (int16_t)0xf777,
@@ -0,0 +1,295 @@
+/*
+ *  Shows recordings of the emulator (started with record=<file>) and
+ *  converts them to raw video, see record.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "record.h"
+
+struct recording
+{
+    FILE *file;
+    record_file_header header;
+    record_index_entry *index;      // Key frames, NULL if the recording wasn't closed
+    uint8_t *pixels;                // Frame decoded last
+    uint8_t *data;                  // Encoded frame
+    uint32_t data_size;
+};
+
+
+static bool open_recording(recording *r, const char *filename)
+{
+    memset(r, 0, sizeof(*r));
+    if ((r->file = fopen(filename, "rb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for reading\n%s\n", filename, strerror(errno));
+        return false;
+    }
+
+    record_file_header *h = &r->header;
+    if (fread(h, sizeof(*h), 1, r->file) != 1 || memcmp(h->magic, RECORD_MAGIC, sizeof(RECORD_MAGIC)) ||
+        h->width == 0 || h->height == 0 || h->width > 4096 || h->height > 4096)
+    {
+        fprintf(stderr, "%s is not a recording\n", filename);
+        return false;
+    }
+
+    if (h->index_offset && h->index_entries)
+    {
+        r->index = (record_index_entry *)malloc(h->index_entries * sizeof(record_index_entry));
+        if (fseeko(r->file, (off_t)h->index_offset, SEEK_SET) != 0 ||
+            fread(r->index, sizeof(record_index_entry), h->index_entries, r->file) != h->index_entries)
+        {
+            fprintf(stderr, "Index of %s is damaged, reading from the start\n", filename);
+            free(r->index);
+            r->index = NULL;
+        }
+    }
+
+    r->pixels = (uint8_t *)calloc(h->width, h->height);
+    fseeko(r->file, h->header_size, SEEK_SET);
+    return true;
+}
+
+// Position at the last key frame not after frame, the next frame read is
+// that one
+static void seek_recording(recording *r, uint64_t frame)
+{
+    uint64_t offset = r->header.header_size;
+
+    if (r->index != NULL)
+    {
+        for (uint64_t i=0; i<r->header.index_entries && r->index[i].frame <= frame; i++)
+        {
+            offset = r->index[i].offset;
+        }
+    }
+    fseeko(r->file, (off_t)offset, SEEK_SET);
+}
+
+
+/*
+ *  Read and decode the next frame, returns false at the end of the
+ *  recording or if it is damaged
+ */
+
+static bool read_frame(recording *r, record_frame_header *fh)
+{
+    const record_file_header *h = &r->header;
+    uint64_t end_offset = h->index_offset ? h->index_offset : UINT64_MAX;
+
+    if ((uint64_t)ftello(r->file) >= end_offset || fread(fh, sizeof(*fh), 1, r->file) != 1)
+    {
+        return false;
+    }
+    if (fh->magic != RECORD_FRAME_MAGIC || (uint64_t)ftello(r->file) + fh->size > end_offset ||
+        fh->size > (h->height+7)/8 + h->height*record_max_line(h->width))
+    {
+        fprintf(stderr, "Frame at %lld is damaged\n", (long long)ftello(r->file) - (long long)sizeof(*fh));
+        return false;
+    }
+
+    if (fh->size > r->data_size)
+    {
+        r->data = (uint8_t *)realloc(r->data, fh->size);
+        r->data_size = fh->size;
+    }
+    if (fh->size && fread(r->data, fh->size, 1, r->file) != 1)
+    {
+        return false;
+    }
+    if (fh->changed == 0)
+    {
+        return true;
+    }
+
+    const uint8_t *in = r->data + (h->height+7)/8;
+    const uint8_t *end = r->data + fh->size;
+    for (uint32_t y=0; y<h->height && in != NULL; y++)
+    {
+        if (r->data[y/8] & (1 << (y%8)))
+        {
+            uint8_t *line = r->pixels + y*h->width;
+            in = record_decode_line(in, end, line, y ? line - h->width : NULL, h->width);
+        }
+    }
+    if (in == NULL)
+    {
+        fprintf(stderr, "Frame %llu is damaged\n", (unsigned long long)fh->frame);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ *  Show the header and statistics of the frames
+ */
+
+static int info(recording *r)
+{
+    const record_file_header *h = &r->header;
+    double rate = h->frame_rate_den ? (double)h->frame_rate_num / h->frame_rate_den : 0;
+
+    printf("%ux%u, %.4f Hz, key frame every %u frames, %s\n", h->width, h->height, rate, h->key_interval,
+        r->index ? "closed" : "not closed (no index)");
+
+    record_frame_header fh;
+    uint64_t frames = 0, keys = 0, unchanged = 0, bytes = 0, lines = 0;
+    uint64_t first_cycle = 0, last_cycle = 0;
+    while (read_frame(r, &fh))
+    {
+        if (frames++ == 0)
+        {
+            first_cycle = fh.cycle;
+        }
+        last_cycle = fh.cycle;
+        keys += fh.key;
+        unchanged += fh.changed == 0;
+        lines += fh.changed;
+        bytes += sizeof(fh) + fh.size;
+    }
+    if (frames == 0)
+    {
+        printf("No frames\n");
+        return 0;
+    }
+
+    double seconds = h->frame_rate_num ? (double)(last_cycle - first_cycle) / h->frame_rate_num : 0;
+    printf("%llu frames (%llu key frames, %llu unchanged), %.1f s\n",
+        (unsigned long long)frames, (unsigned long long)keys, (unsigned long long)unchanged, seconds);
+    printf("%llu bytes, %.0f bytes and %.1f changed lines per frame, %.2f%% of the indexed size\n",
+        (unsigned long long)bytes, (double)bytes / frames, (double)lines / frames,
+        100.0 * bytes / ((double)frames * h->width * h->height));
+    return 0;
+}
+
+
+/*
+ *  Convert frames to YUV4MPEG2 4:4:4 (BT.601 limited range), RGBA bytes
+ *  or color indexes
+ */
+
+static int convert(recording *r, const char *format, const char *filename, uint64_t first, uint64_t count)
+{
+    const record_file_header *h = &r->header;
+    uint32_t n = h->width * h->height;
+    enum { OUT_Y4M, OUT_RAW, OUT_INDEXED } out_format;
+
+    if (!strcmp(format, "y4m"))
+    {
+        out_format = OUT_Y4M;
+    }
+    else if (!strcmp(format, "raw"))
+    {
+        out_format = OUT_RAW;
+    }
+    else if (!strcmp(format, "indexed"))
+    {
+        out_format = OUT_INDEXED;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown format %s\n", format);
+        return 1;
+    }
+
+    FILE *out = !strcmp(filename, "-") ? stdout : fopen(filename, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n%s\n", filename, strerror(errno));
+        return 1;
+    }
+    bool ok = true;
+    if (out_format == OUT_Y4M)
+    {
+        ok = fprintf(out, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C444\n",
+            h->width, h->height, h->frame_rate_num, h->frame_rate_den) > 0;
+    }
+
+    uint8_t *buffer = (uint8_t *)malloc(4*n);
+    record_frame_header fh;
+    uint64_t written = 0;
+
+    seek_recording(r, first);
+    while (ok && written < count && read_frame(r, &fh))
+    {
+        if (fh.frame < first)
+        {
+            continue;
+        }
+
+        switch (out_format)
+        {
+            case OUT_Y4M:
+                ok = fputs("FRAME\n", out) >= 0;
+                for (uint32_t i=0; i<n; i++)
+                {
+                    uint32_t c = h->palette[r->pixels[i] & 15];
+                    int red = c >> 24, g = (c >> 16) & 0xff, b = (c >> 8) & 0xff;
+
+                    buffer[i] = ((66*red + 129*g + 25*b + 128) >> 8) + 16;
+                    buffer[n+i] = ((-38*red - 74*g + 112*b + 128) >> 8) + 128;
+                    buffer[2*n+i] = ((112*red - 94*g - 18*b + 128) >> 8) + 128;
+                }
+                ok = ok && fwrite(buffer, 3*n, 1, out) == 1;
+                break;
+
+            case OUT_RAW:
+                for (uint32_t i=0; i<n; i++)
+                {
+                    uint32_t c = h->palette[r->pixels[i] & 15];
+                    buffer[4*i] = c >> 24;
+                    buffer[4*i+1] = c >> 16;
+                    buffer[4*i+2] = c >> 8;
+                    buffer[4*i+3] = c;
+                }
+                ok = fwrite(buffer, 4*n, 1, out) == 1;
+                break;
+
+            default:
+                ok = fwrite(r->pixels, n, 1, out) == 1;
+                break;
+        }
+        written += ok;
+    }
+
+    free(buffer);
+    if ((out != stdout ? fclose(out) : fflush(out)) != 0)
+    {
+        ok = false;
+    }
+    fprintf(stderr, "%llu frames written\n", (unsigned long long)written);
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to write %s\n%s\n", filename, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    recording r;
+
+    if (argc == 3 && !strcmp(argv[1], "info"))
+    {
+        return open_recording(&r, argv[2]) ? info(&r) : 1;
+    }
+    if (argc >= 5 && argc <= 7 && !strcmp(argv[1], "convert"))
+    {
+        uint64_t first = argc > 5 ? strtoull(argv[5], NULL, 10) : 1;
+        uint64_t count = argc > 6 ? strtoull(argv[6], NULL, 10) : UINT64_MAX;
+        return open_recording(&r, argv[2]) ? convert(&r, argv[3], argv[4], first, count) : 1;
+    }
+
+    fprintf(stderr, "Usage: c64rec info <recording>\n"
+                    "       c64rec convert <recording> y4m|raw|indexed <file or -> [first frame] [frames]\n");
+    return 1;
+}
@@ -9,58 +9,181 @@
 
 #include <SDL.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <math.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 
-// Display surface
+// Display surface, only used by the present thread. The surface is only
+// drawn into if the texture can't be locked
+static SDL_Window *window = NULL;
 static SDL_Surface *screen = NULL;
 static SDL_Renderer *renderer = NULL;
 static SDL_Texture *texture = NULL;
+static bool display_exposed;    // Flag: Window must be presented even if no line changed
+
+// Lines of the texture, only the lines that changed are uploaded
+static uint64_t texture_hash[DISPLAY_Y];   // Hash of the pixels of each line
+static bool texture_stale[DISPLAY_Y];      // Flags: Line must be uploaded, regardless of the hash
+static bool texture_dirty[DISPLAY_Y];      // Flags: Line is uploaded in this update
+static bool texture_locking = true;        // Flag: Lines are drawn into the locked texture, not the surface
+
+// Scaling, by the GPU (1) or by the CPU (2..4) into a texture of the final
+// size. CPU scaling is sharp and doesn't depend on the renderer
+static int display_scale = 1;              // Scale factor of the CPU scaler
+static bool display_scanlines;             // Flag: Last row of each scaled line is darkened
+static SDL_Surface *scaled_screen = NULL;  // Scaled lines, if the texture can't be locked
+
+// Cost of presenting, to compare GPU and CPU scaling
+static uint32_t present_frames;            // Number of frames presented
+static uint32_t present_last_number;       // Number of the last frame presented
+static uint64_t present_upload_ns;         // Time spent drawing lines into the texture
+static uint64_t present_render_ns;         // Time spent rendering and presenting
+static uint64_t present_upload_max_ns;
+
+// Frames, see display.h. The VIC hands each complete frame over at vblank
+// by swapping it with the one in display_ready, the present thread takes
+// it from there. Neither waits for the other
+static const int FRAME_FRESH = 4;          // Flag in display_ready: Frame not taken yet
+static display_frame display_frames[3];
+static int display_ready = 1;              // Index of the last complete frame
+static uint32_t display_frame_count;       // Number of frames handed over
+
+// Present thread
+static pthread_t present_thread;
+static pthread_mutex_t present_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t present_cond = PTHREAD_COND_INITIALIZER;
+static bool present_waiting;               // Flag: Present thread waits for a frame
+static bool present_quit;                  // Flag: Present thread must exit
+static int present_status;                 // Result of opening the window, 0 while opening
+
+// Text drawn over the frames by the present thread
+struct display_text
+{
+    int x, y;
+    uint8_t front, back;
+    char shown[32];     // Text in the display surface, empty if none
+};
+
+static const char *message_string;         // Message in the middle of the screen, NULL if none
+static display_text message_text = {96, 120, 14, 0, ""};
+
+// Performance HUD, drawn into its own texture that is copied over the
+// frames. Nothing is drawn or measured while it is hidden
+static const int HUD_COLUMNS = 24;
+static const int HUD_ROWS = 7;
+static const uint32_t HUD_BACK_ALPHA = 0xc0;
+static SDL_Texture *hud_texture = NULL;
+static uint32_t hud_pixels[HUD_ROWS*8][HUD_COLUMNS*8];
+static uint32_t hud_drawn;                 // Number of the snapshot in the texture
+static bool hud_shown;                     // Flag: HUD is in the presented frame
+static uint64_t hud_present_ns;            // Presenting time and frames at the last snapshot
+static uint32_t hud_present_frames;
+static uint32_t present_taken;             // Number of the last frame taken
+static uint32_t present_dropped;           // Frames overwritten before they were taken
 
 #ifdef FAKE_PI
-static struct timeval tv_start;
-static double speed_index;
-static char speedometer_string[16]; // Speedometer text
+// Frame pacing of replays, unthrottled while debug_turbo is set. Each frame
+// has an absolute deadline, so wake-up errors don't add up
+static const int PaceResyncFrames = 5;     // Frames behind the deadline before the pacing restarts
+static double pace_speed = 1.0;            // Speed relative to the C64 when throttled
+static bool pace_throttled;                // Flag: Deadlines are for throttled frames
+static uint64_t pace_start_ns;             // Deadline of frame 0, 0 if not started
+static uint32_t pace_frames;               // Frames since pace_start_ns
+static uint32_t pace_resyncs;              // Times the deadlines were restarted
+static uint32_t pace_late_frames;          // Throttled frames and their wake-up error
+static uint64_t pace_late_ns, pace_late_max_ns;
+static double pace_late_sq;
+static uint64_t speed_start_ns, speed_last_ns;      // First and last frame of the run
+static uint32_t speed_frames;                       // Frames since then
+static double pace_frame_ns;               // Duration of a frame of the C64
 #endif
 
+static void *present_main(void *arg);
+
 
 /*
- *  Open window
+ *  Open window, this is done by the present thread
  */
 
-static int display_init(void)
+static int display_init(int argc, char *argv[])
 {
+    // Scaling is done by the GPU unless a CPU scale factor is given
+    for (int i=0; i<argc; i++)
+    {
+        if (!strcmp(argv[i], "2x") || !strcmp(argv[i], "3x") || !strcmp(argv[i], "4x"))
+        {
+            display_scale = argv[i][0] - '0';
+        }
+        else if (!strcmp(argv[i], "scanlines"))
+        {
+            display_scanlines = true;
+        }
+#ifdef FAKE_PI
+        // Replay speed, unthrottled by default. Keypad + toggles throttling
+        else if (!strcmp(argv[i], "realtime"))
+        {
+            debug_turbo = false;
+        }
+        else if (!strncmp(argv[i], "speed=", 6) && atof(argv[i] + 6) > 0)
+        {
+            pace_speed = atof(argv[i] + 6);
+            debug_turbo = false;
+        }
+        else if (!strcmp(argv[i], "unthrottled"))
+        {
+            debug_turbo = true;
+        }
+#endif
+        else
+        {
+#ifdef FAKE_PI
+            fprintf(stderr, "Usage: emulator [pal|ntsc|ntsc-old] [shm] [record=<file>] [2x|3x|4x] [scanlines] [realtime|speed=<factor>|unthrottled]\n");
+#else
+            fprintf(stderr, "Usage: emulator [pal|ntsc|ntsc-old] [shm] [record=<file>] [2x|3x|4x] [scanlines]\n");
+#endif
+            return 0;
+        }
+    }
+    if (display_scale == 1)
+    {
+        display_scanlines = false;
+    }
+
     // Init SDL
-    if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO) != 0)
+    if (SDL_Init(SDL_INIT_AUDIO) != 0)
     {
         fprintf(stderr, "Couldn't initialize SDL (%s)\n", SDL_GetError());
         return 0;
     }
 
-    SDL_ShowCursor(SDL_DISABLE);
-    screen = SDL_CreateRGBSurface(0, DISPLAY_X, DISPLAY_Y, 32,
-                                  0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-
-    display_bitmap_base = (uint32_t *)screen->pixels;
-    display_bitmap_xmod = screen->pitch/sizeof(uint32_t);
+    display_draw_frame = &display_frames[0];
+    display_bitmap_base = display_draw_frame->pixels;
+    display_bitmap_xmod = DISPLAY_X;
 
-    // Open window
-    SDL_Window *window = SDL_CreateWindow("C64 - Pi",
-                                          SDL_WINDOWPOS_UNDEFINED,
-                                          SDL_WINDOWPOS_UNDEFINED,
-                                          DISPLAY_X * 2, DISPLAY_Y * 2,
-                                          SDL_WINDOW_RESIZABLE);
-
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-    SDL_RenderSetLogicalSize(renderer, DISPLAY_X, DISPLAY_Y);
+    if (pthread_create(&present_thread, NULL, present_main, NULL) != 0)
+    {
+        return 0;
+    }
 
-    texture = SDL_CreateTexture(renderer,
-                                SDL_PIXELFORMAT_RGBA8888,
-                                SDL_TEXTUREACCESS_STREAMING,
-                                DISPLAY_X, DISPLAY_Y);
-    display_update();
+    pthread_mutex_lock(&present_mutex);
+    while (present_status == 0)
+    {
+        pthread_cond_wait(&present_cond, &present_mutex);
+    }
+    pthread_mutex_unlock(&present_mutex);
 
+    if (present_status < 0)
+    {
+        pthread_join(present_thread, NULL);
+        return 0;
+    }
     return 1;
 }
 
@@ -71,38 +194,147 @@ static int display_init(void)
 
 static void display_close(void)
 {
+    pthread_mutex_lock(&present_mutex);
+    present_quit = true;
+    pthread_cond_signal(&present_cond);
+    pthread_mutex_unlock(&present_mutex);
+    pthread_join(present_thread, NULL);
+
+    if (present_frames)
+    {
+        char scaling[32] = "GPU";
+        if (display_scale > 1)
+        {
+            sprintf(scaling, "%dx CPU", display_scale);
+        }
+        printf("Present: %u frames, %s scaling%s. Upload %.0f us (max %.0f us), render %.0f us per frame\n",
+            present_frames, scaling, display_scanlines ? " with scanlines" : "",
+            present_upload_ns / 1000.0 / present_frames, present_upload_max_ns / 1000.0,
+            present_render_ns / 1000.0 / present_frames);
+    }
+
+#ifdef FAKE_PI
+    if (speed_frames)
+    {
+        double elapsed = (double)(speed_last_ns - speed_start_ns);
+        char mode[32] = "unthrottled";
+        if (!debug_turbo)
+        {
+            sprintf(mode, "%.0f%% speed", pace_speed * 100);
+        }
+        printf("Pacing: %.4f Hz frames, %s (%.1f%% achieved), %u resyncs",
+            1e9 / pace_frame_ns, mode, speed_frames * pace_frame_ns / elapsed * 100, pace_resyncs);
+        if (pace_late_frames)
+        {
+            double mean = (double)pace_late_ns / pace_late_frames;
+            printf(". Wake-up error %.0f us (jitter %.0f us, max %.0f us)",
+                mean / 1000, sqrt(fmax(pace_late_sq / pace_late_frames - mean * mean, 0)) / 1000, pace_late_max_ns / 1000.0);
+        }
+        printf("\n");
+    }
+#endif
+
 	SDL_Quit();
 }
 
 
 /*
- *  Redraw bitmap
+ *  Copy lines first..last-1 of a frame to dst, with xmod pixels per row.
+ *  Color indexes are converted to RGBA, looking up 16 (SSSE3) or 8 (NEON)
+ *  pixels at a time in the palette, one byte of each color at a time
  */
 
-static void display_update(void)
+static void display_convert(const display_frame *f, int first, int last, uint32_t *dst, int xmod)
 {
-    SDL_UpdateTexture(texture, NULL, screen->pixels, screen->pitch);
+    const pixel_t *src = f->pixels + first*DISPLAY_X;
 
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+#ifdef INDEXED_DISPLAY
+
+#if defined(__SSSE3__) || defined(__ARM_NEON)
+    uint8_t chan[4][16];    // Byte n of the palette colors
+    for (int n=0; n<4; n++)
+        for (int i=0; i<16; i++)
+            chan[n][i] = palette[i] >> (n*8);
+#endif
+
+#if defined(__SSSE3__)
+    __m128i c0 = _mm_loadu_si128((__m128i *)chan[0]);
+    __m128i c1 = _mm_loadu_si128((__m128i *)chan[1]);
+    __m128i c2 = _mm_loadu_si128((__m128i *)chan[2]);
+    __m128i c3 = _mm_loadu_si128((__m128i *)chan[3]);
+
+    for (int y=first; y<last; y++, src+=DISPLAY_X, dst+=xmod)
+    {
+        for (int x=0; x<DISPLAY_X; x+=16)
+        {
+            __m128i idx = _mm_loadu_si128((__m128i *)(src + x));
+            __m128i b01, b23;
+
+            b01 = _mm_unpacklo_epi8(_mm_shuffle_epi8(c0, idx), _mm_shuffle_epi8(c1, idx));
+            b23 = _mm_unpacklo_epi8(_mm_shuffle_epi8(c2, idx), _mm_shuffle_epi8(c3, idx));
+            _mm_storeu_si128((__m128i *)(dst + x), _mm_unpacklo_epi16(b01, b23));
+            _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_unpackhi_epi16(b01, b23));
+
+            b01 = _mm_unpackhi_epi8(_mm_shuffle_epi8(c0, idx), _mm_shuffle_epi8(c1, idx));
+            b23 = _mm_unpackhi_epi8(_mm_shuffle_epi8(c2, idx), _mm_shuffle_epi8(c3, idx));
+            _mm_storeu_si128((__m128i *)(dst + x + 8), _mm_unpacklo_epi16(b01, b23));
+            _mm_storeu_si128((__m128i *)(dst + x + 12), _mm_unpackhi_epi16(b01, b23));
+        }
+    }
+#elif defined(__ARM_NEON)
+    uint8x8x2_t c[4];
+    for (int n=0; n<4; n++)
+    {
+        c[n].val[0] = vld1_u8(chan[n]);
+        c[n].val[1] = vld1_u8(chan[n] + 8);
+    }
+
+    for (int y=first; y<last; y++, src+=DISPLAY_X, dst+=xmod)
+    {
+        for (int x=0; x<DISPLAY_X; x+=8)
+        {
+            uint8x8_t idx = vld1_u8(src + x);
+            uint8x8x4_t rgba;
+
+            rgba.val[0] = vtbl2_u8(c[0], idx);
+            rgba.val[1] = vtbl2_u8(c[1], idx);
+            rgba.val[2] = vtbl2_u8(c[2], idx);
+            rgba.val[3] = vtbl2_u8(c[3], idx);
+            vst4_u8((uint8_t *)(dst + x), rgba);
+        }
+    }
+#else
+    for (int y=first; y<last; y++, src+=DISPLAY_X, dst+=xmod)
+        for (int x=0; x<DISPLAY_X; x++)
+            dst[x] = palette[src[x]];
+#endif
+#else
+    for (int y=first; y<last; y++, src+=DISPLAY_X, dst+=xmod)
+        memcpy(dst, src, DISPLAY_X*sizeof(uint32_t));
+#endif
 }
 
 
 /*
- *  Draw string into surface using the C64 ROM font
+ *  Draw string using the C64 ROM font, only the pixels in lines
+ *  first..last-1 are drawn. dst points to line first, with xmod pixels
+ *  per row
  */
 
-static void display_draw_string(int x, int y, const char *str, uint32_t front_color, uint32_t back_color)
+static void display_draw_string(int x, int y, const char *str, uint8_t front, uint8_t back,
+                                int first, int last, uint32_t *dst, int xmod)
 {
-	SDL_Surface *s = screen;
-	uint32_t *pb = (uint32_t *)s->pixels + s->pitch*y/sizeof(uint32_t) + x;
+	uint32_t front_color = palette[front];
+	uint32_t back_color = palette[back];
+	int row_first = first > y ? first - y : 0;
+	int row_last = last < y+8 ? last - y : 8;
+	uint32_t *pb = dst + (y + row_first - first)*xmod + x;
 	char c;
 	while ((c = *str++) != 0) {
 		uint8_t *q = char_rom + c*8 + 0x800;
 		uint32_t *p = pb;
-		for (int y=0; y<8; y++) {
-			uint8_t v = *q++;
+		for (int y=row_first; y<row_last; y++) {
+			uint8_t v = q[y];
 			p[0] = (v & 0x80) ? front_color : back_color;
 			p[1] = (v & 0x40) ? front_color : back_color;
 			p[2] = (v & 0x20) ? front_color : back_color;
@@ -111,12 +343,375 @@ static void display_draw_string(int x, int y, const char *str, uint32_t front_co
 			p[5] = (v & 0x04) ? front_color : back_color;
 			p[6] = (v & 0x02) ? front_color : back_color;
 			p[7] = (v & 0x01) ? front_color : back_color;
-			p += s->pitch/sizeof(uint32_t);
+			p += xmod;
 		}
 		pb += 8;
 	}
 }
 
+
+/*
+ *  Set the text shown over the frames, the lines under it are uploaded
+ *  again if it changed
+ */
+
+static bool display_set_text(display_text *t, const char *str)
+{
+    if (!strcmp(t->shown, str))
+    {
+        return false;
+    }
+
+    snprintf(t->shown, sizeof(t->shown), "%s", str);
+    for (int y=t->y; y<t->y+8; y++)
+    {
+        texture_stale[y] = true;
+    }
+    return true;
+}
+
+static void display_draw_text(const display_text *t, int first, int last, uint32_t *dst, int xmod)
+{
+    if (t->shown[0] && t->y < last && t->y+8 > first)
+    {
+        display_draw_string(t->x, t->y, t->shown, t->front, t->back, first, last, dst, xmod);
+    }
+}
+
+static bool display_update_texts(void)
+{
+    const char *message = __atomic_load_n(&message_string, __ATOMIC_ACQUIRE);
+    bool changed = display_set_text(&message_text, message ? message : "");
+
+    return changed;
+}
+
+
+/*
+ *  Draw the HUD into its texture when there are new stats, or hide it.
+ *  Returns true if the window must be presented again
+ */
+
+static bool display_update_hud(void)
+{
+    if (!__atomic_load_n(&hud_visible, __ATOMIC_RELAXED) || hud_texture == NULL)
+    {
+        bool hidden = hud_shown;
+        hud_shown = false;
+        return hidden;
+    }
+
+    pthread_mutex_lock(&hud_mutex);
+    hud_stats st = hud_snapshot;
+    uint32_t count = hud_snapshot_count;
+    pthread_mutex_unlock(&hud_mutex);
+    if (hud_shown && count == hud_drawn)
+    {
+        return false;
+    }
+
+    // Presenting time per frame since the last snapshot
+    uint64_t present_ns = present_upload_ns + present_render_ns;
+    uint32_t frames = present_frames - hud_present_frames;
+    uint32_t present_us = frames ? (uint32_t)((present_ns - hud_present_ns) / 1000 / frames) : 0;
+    hud_present_ns = present_ns;
+    hud_present_frames = present_frames;
+
+    char rows[HUD_ROWS][HUD_COLUMNS+1];
+    memset(rows, 0, sizeof(rows));
+    if (!hud_shown || count == 0)
+    {
+        // Stats are measured from when the HUD is shown
+        snprintf(rows[0], sizeof(rows[0]), "MEASURING...");
+    }
+    else
+    {
+        snprintf(rows[0], sizeof(rows[0]), "SPEED%6.1f%%%8u C/S", st.speed, st.cycles_per_sec);
+        snprintf(rows[1], sizeof(rows[1]), "DMA %6u CYC %4.1f CHK", st.headroom, st.headroom_chunks);
+        snprintf(rows[2], sizeof(rows[2]), "CPU  %3u%%   VIC  %3u%%", st.cpu, st.vic);
+        snprintf(rows[3], sizeof(rows[3]), "SID  %3u%%   WAIT %3u%%", st.sid, st.wait);
+        snprintf(rows[4], sizeof(rows[4]), "PRESENT %6u US/FRAME", present_us);
+        snprintf(rows[5], sizeof(rows[5]), "SKIP %6u DROP %6u", st.frames_skipped, present_dropped);
+        snprintf(rows[6], sizeof(rows[6]), "SYNC %-10s LOST %3u", st.in_sync ? "LOCKED" : "NOT LOCKED", st.sync_losses);
+    }
+
+    for (int r=0; r<HUD_ROWS; r++)
+    {
+        int n = strlen(rows[r]);
+        memset(rows[r] + n, ' ', HUD_COLUMNS - n);
+        display_draw_string(0, r*8, rows[r], 13, 0, 0, HUD_ROWS*8, hud_pixels[0], HUD_COLUMNS*8);
+    }
+
+    // The background is translucent
+    uint32_t back = (palette[0] & ~0xff) | HUD_BACK_ALPHA;
+    for (int y=0; y<HUD_ROWS*8; y++)
+        for (int x=0; x<HUD_COLUMNS*8; x++)
+            if (hud_pixels[y][x] == palette[0])
+                hud_pixels[y][x] = back;
+
+    SDL_UpdateTexture(hud_texture, NULL, hud_pixels, sizeof(hud_pixels[0]));
+    hud_drawn = count;
+    hud_shown = true;
+    return true;
+}
+
+
+/*
+ *  Scale a row of RGBA pixels horizontally by S, 4 pixels at a time with
+ *  SSE2 or NEON
+ */
+
+template <int S> static void display_scale_row(const uint32_t *src, uint32_t *dst)
+{
+#if defined(__SSE2__)
+    for (int x=0; x<DISPLAY_X; x+=4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i *d = (__m128i *)(dst + x*S);
+
+        if (S == 2)
+        {
+            _mm_storeu_si128(d, _mm_unpacklo_epi32(v, v));
+            _mm_storeu_si128(d + 1, _mm_unpackhi_epi32(v, v));
+        }
+        else if (S == 3)
+        {
+            _mm_storeu_si128(d, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+            _mm_storeu_si128(d + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+            _mm_storeu_si128(d + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+        }
+        else
+        {
+            _mm_storeu_si128(d, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 0, 0, 0)));
+            _mm_storeu_si128(d + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1, 1)));
+            _mm_storeu_si128(d + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 2, 2)));
+            _mm_storeu_si128(d + 3, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)));
+        }
+    }
+#elif defined(__ARM_NEON)
+    // Storing the same vector interleaved S times repeats each pixel S times
+    for (int x=0; x<DISPLAY_X; x+=4)
+    {
+        uint32x4_t v = vld1q_u32(src + x);
+
+        if (S == 2)
+        {
+            uint32x4x2_t d = {{v, v}};
+            vst2q_u32(dst + x*S, d);
+        }
+        else if (S == 3)
+        {
+            uint32x4x3_t d = {{v, v, v}};
+            vst3q_u32(dst + x*S, d);
+        }
+        else
+        {
+            uint32x4x4_t d = {{v, v, v, v}};
+            vst4q_u32(dst + x*S, d);
+        }
+    }
+#else
+    for (int x=0; x<DISPLAY_X; x++)
+        for (int i=0; i<S; i++)
+            dst[x*S + i] = src[x];
+#endif
+}
+
+
+/*
+ *  Darken a row of RGBA pixels to half brightness, for scanlines
+ */
+
+static void display_darken_row(uint32_t *p, int width)
+{
+    int x = 0;
+
+#if defined(__SSE2__)
+    __m128i rgb = _mm_set1_epi32(0x7f7f7f00);
+    __m128i alpha = _mm_set1_epi32(0xff);
+    for (; x<width; x+=4)
+    {
+        __m128i v = _mm_loadu_si128((__m128i *)(p + x));
+        v = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 1), rgb), _mm_and_si128(v, alpha));
+        _mm_storeu_si128((__m128i *)(p + x), v);
+    }
+#elif defined(__ARM_NEON)
+    uint32x4_t rgb = vdupq_n_u32(0x7f7f7f00);
+    uint32x4_t alpha = vdupq_n_u32(0xff);
+    for (; x<width; x+=4)
+    {
+        uint32x4_t v = vld1q_u32(p + x);
+        vst1q_u32(p + x, vorrq_u32(vandq_u32(vshrq_n_u32(v, 1), rgb), vandq_u32(v, alpha)));
+    }
+#endif
+
+    for (; x<width; x++)
+        p[x] = ((p[x] >> 1) & 0x7f7f7f00) | (p[x] & 0xff);
+}
+
+
+/*
+ *  Scale lines of RGBA pixels by display_scale in both directions, from
+ *  src with sxmod pixels per row to dst with dxmod pixels per row
+ */
+
+static void display_scale_lines(const uint32_t *src, int sxmod, int lines, uint32_t *dst, int dxmod)
+{
+    int s = display_scale;
+    int width = DISPLAY_X*s;
+
+    for (int l=0; l<lines; l++, src+=sxmod, dst+=s*dxmod)
+    {
+        switch (s)
+        {
+            case 2:
+                display_scale_row<2>(src, dst);
+                break;
+            case 3:
+                display_scale_row<3>(src, dst);
+                break;
+            default:
+                display_scale_row<4>(src, dst);
+                break;
+        }
+
+        for (int r=1; r<s; r++)
+            memcpy(dst + r*dxmod, dst, width*sizeof(uint32_t));
+        if (display_scanlines)
+            display_darken_row(dst + (s-1)*dxmod, width);
+    }
+}
+
+
+/*
+ *  Lines first..last-1 of a frame with the texts over them, at dst with
+ *  xmod pixels per row
+ */
+
+static void display_draw_lines(const display_frame *f, int first, int last, uint32_t *dst, int xmod)
+{
+    display_convert(f, first, last, dst, xmod);
+    display_draw_text(&message_text, first, last, dst, xmod);
+}
+
+
+/*
+ *  Upload lines first..last-1 of a frame. They are drawn directly into the
+ *  locked texture, or into a surface and copied to the texture if it
+ *  can't be locked. With CPU scaling the lines are drawn into the display
+ *  surface first and scaled from there
+ */
+
+static void display_upload_lines(const display_frame *f, int first, int last)
+{
+    int s = display_scale;
+    SDL_Rect rect = {0, first*s, DISPLAY_X*s, (last - first)*s};
+    uint32_t *line = (uint32_t *)((uint8_t *)screen->pixels + first*screen->pitch);
+    int line_xmod = screen->pitch/sizeof(uint32_t);
+    void *pixels;
+    int pitch;
+
+    if (s > 1)
+    {
+        display_draw_lines(f, first, last, line, line_xmod);
+    }
+
+    if (texture_locking && SDL_LockTexture(texture, &rect, &pixels, &pitch) == 0)
+    {
+        if (s > 1)
+            display_scale_lines(line, line_xmod, last - first, (uint32_t *)pixels, pitch/sizeof(uint32_t));
+        else
+            display_draw_lines(f, first, last, (uint32_t *)pixels, pitch/sizeof(uint32_t));
+        SDL_UnlockTexture(texture);
+        return;
+    }
+    texture_locking = false;
+
+    if (s > 1)
+    {
+        pixels = (uint8_t *)scaled_screen->pixels + first*s*scaled_screen->pitch;
+        pitch = scaled_screen->pitch;
+        display_scale_lines(line, line_xmod, last - first, (uint32_t *)pixels, pitch/sizeof(uint32_t));
+    }
+    else
+    {
+        pixels = line;
+        pitch = screen->pitch;
+        display_draw_lines(f, first, last, line, line_xmod);
+    }
+    SDL_UpdateTexture(texture, &rect, pixels, pitch);
+}
+
+
+/*
+ *  Redraw frame, only the runs of changed lines are uploaded. Frames
+ *  identical to the last one aren't presented
+ */
+
+static void display_update(const display_frame *f)
+{
+    bool changed = false;
+    uint64_t start = latency_now();
+
+    for (int y=0; y<DISPLAY_Y; y++)
+    {
+        texture_dirty[y] = texture_stale[y] || f->line_hash[y] != texture_hash[y];
+        texture_stale[y] = false;
+        texture_hash[y] = f->line_hash[y];
+    }
+
+    for (int y=0; y<DISPLAY_Y;)
+    {
+        if (!texture_dirty[y])
+        {
+            y++;
+            continue;
+        }
+
+        int first = y;
+        while (y < DISPLAY_Y && texture_dirty[y])
+        {
+            y++;
+        }
+
+        display_upload_lines(f, first, y);
+        changed = true;
+    }
+
+    if (!changed && !display_exposed)
+    {
+        return;
+    }
+    display_exposed = false;
+    uint64_t uploaded = latency_now();
+
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    if (hud_shown)
+    {
+        int s = display_scale;
+        SDL_Rect rect = {8 * s, 8 * s, HUD_COLUMNS*8 * s, HUD_ROWS*8 * s};
+        SDL_RenderCopy(renderer, hud_texture, NULL, &rect);
+    }
+    SDL_RenderPresent(renderer);
+
+    // A frame is presented again when only the texts changed
+    if (f->number != present_last_number)
+    {
+        present_last_number = f->number;
+        latency_presented(f);
+    }
+
+    present_frames++;
+    present_upload_ns += uploaded - start;
+    present_render_ns += latency_now() - uploaded;
+    if (uploaded - start > present_upload_max_ns)
+    {
+        present_upload_max_ns = uploaded - start;
+    }
+}
+
+
 static void display_poll_keyboard()
 {
 	SDL_Event event;
@@ -129,11 +724,15 @@ static void display_poll_keyboard()
 				switch (event.key.keysym.sym)
 				{
 					case SDLK_F4:	    // F4: Quit
-						quit_requested = true;
+						__atomic_store_n(&quit_requested, true, __ATOMIC_RELAXED);
+						break;
+
+					case SDLK_F1:	    // F1: Performance HUD on/off
+						__atomic_store_n(&hud_visible, !hud_visible, __ATOMIC_RELAXED);
 						break;
 
 					case SDLK_KP_PLUS:	// '+' on keypad: turbo mode (debug)
-						debug_turbo = !debug_turbo;
+						__atomic_store_n(&debug_turbo, !debug_turbo, __ATOMIC_RELAXED);
 						break;
 
         			default:
@@ -142,7 +741,12 @@ static void display_poll_keyboard()
 				break;
 
 			case SDL_QUIT:
-				quit_requested = true; 
+				__atomic_store_n(&quit_requested, true, __ATOMIC_RELAXED);
+				break;
+
+			// Window resized or uncovered, present the frame again
+			case SDL_WINDOWEVENT:
+				display_exposed = true;
 				break;
 
 			default:
@@ -151,46 +755,287 @@ static void display_poll_keyboard()
 	}
 }
 
-static void vic_vblank()
+
+/*
+ *  Present thread, opens the window and presents the latest complete frame
+ *  whenever there is a new one. Events are polled at least every 10 ms
+ */
+
+static int present_open(void)
 {
-    display_poll_keyboard();
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO) != 0)
+    {
+        fprintf(stderr, "Couldn't initialize SDL video (%s)\n", SDL_GetError());
+        return -1;
+    }
 
-#ifdef FAKE_PI
-    display_draw_string(0, DISPLAY_Y - 8, speedometer_string, palette[6], palette[0]);
-#endif
+    SDL_ShowCursor(SDL_DISABLE);
+    screen = SDL_CreateRGBSurface(0, DISPLAY_X, DISPLAY_Y, 32,
+                                  0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+
+    // With CPU scaling the texture has the final size, and the GPU
+    // only copies it
+    int s = display_scale;
+    if (s > 1)
+    {
+        scaled_screen = SDL_CreateRGBSurface(0, DISPLAY_X * s, DISPLAY_Y * s, 32,
+                                             0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    }
+
+    // Open window
+    window = SDL_CreateWindow("C64 - Pi",
+                              SDL_WINDOWPOS_UNDEFINED,
+                              SDL_WINDOWPOS_UNDEFINED,
+                              DISPLAY_X * (s > 1 ? s : 2), DISPLAY_Y * (s > 1 ? s : 2),
+                              SDL_WINDOW_RESIZABLE);
+
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, s > 1 ? "nearest" : "linear");
+    SDL_RenderSetLogicalSize(renderer, DISPLAY_X * s, DISPLAY_Y * s);
+
+    texture = SDL_CreateTexture(renderer,
+                                SDL_PIXELFORMAT_RGBA8888,
+                                SDL_TEXTUREACCESS_STREAMING,
+                                DISPLAY_X * s, DISPLAY_Y * s);
+    if (screen == NULL || (s > 1 && scaled_screen == NULL) ||
+        window == NULL || renderer == NULL || texture == NULL)
+    {
+        fprintf(stderr, "Couldn't open window (%s)\n", SDL_GetError());
+        return -1;
+    }
+
+    // Without it the HUD isn't shown
+    hud_texture = SDL_CreateTexture(renderer,
+                                    SDL_PIXELFORMAT_RGBA8888,
+                                    SDL_TEXTUREACCESS_STATIC,
+                                    HUD_COLUMNS*8, HUD_ROWS*8);
+    if (hud_texture != NULL)
+    {
+        SDL_SetTextureBlendMode(hud_texture, SDL_BLENDMODE_BLEND);
+    }
+    return 1;
+}
+
+static void *present_main(void *arg)
+{
+    (void)arg; // ignore
+
+    int status = present_open();
+    pthread_mutex_lock(&present_mutex);
+    present_status = status;
+    pthread_cond_signal(&present_cond);
+    pthread_mutex_unlock(&present_mutex);
+    if (status < 0)
+    {
+        return NULL;
+    }
+
+    // Frame presented, black until the first one is complete
+    int idx = 2;
+    memset(texture_stale, true, sizeof(texture_stale));
+    display_update(&display_frames[idx]);
+
+    for (;;)
+    {
+        display_poll_keyboard();
+        latency_poll_print();
+        bool texts_changed = display_update_texts();
+        if (display_update_hud())
+        {
+            display_exposed = true;
+        }
+
+        if (__atomic_load_n(&display_ready, __ATOMIC_SEQ_CST) & FRAME_FRESH)
+        {
+            idx = __atomic_exchange_n(&display_ready, idx, __ATOMIC_ACQ_REL) & 3;
+            uint32_t number = display_frames[idx].number;
+            if (present_taken && number > present_taken + 1)
+            {
+                present_dropped += number - present_taken - 1;
+            }
+            present_taken = number;
+            display_update(&display_frames[idx]);
+            continue;
+        }
+        if (texts_changed || display_exposed)
+        {
+            display_update(&display_frames[idx]);
+        }
+
+        // Wait for the next frame
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if ((ts.tv_nsec += 10000000) >= 1000000000)
+        {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+
+        pthread_mutex_lock(&present_mutex);
+        __atomic_store_n(&present_waiting, true, __ATOMIC_SEQ_CST);
+        if (!present_quit && !(__atomic_load_n(&display_ready, __ATOMIC_SEQ_CST) & FRAME_FRESH))
+        {
+            pthread_cond_timedwait(&present_cond, &present_mutex, &ts);
+        }
+        __atomic_store_n(&present_waiting, false, __ATOMIC_SEQ_CST);
+        bool quit = present_quit;
+        pthread_mutex_unlock(&present_mutex);
+        if (quit)
+        {
+            break;
+        }
+    }
+
+    if (hud_texture != NULL)
+    {
+        SDL_DestroyTexture(hud_texture);
+    }
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_FreeSurface(screen);
+    if (scaled_screen != NULL)
+    {
+        SDL_FreeSurface(scaled_screen);
+    }
+    return NULL;
+}
+
+
+/*
+ *  Hand the frame drawn by the VIC over to the present thread, and take
+ *  the free frame for the next one. This never waits
+ */
+
+static void display_swap(void)
+{
+    display_draw_frame->number = ++display_frame_count;
+    if (LatencyStats)
+    {
+        display_draw_frame->bus_ns = latency_bus_ns;
+        display_draw_frame->vblank_ns = latency_now();
+    }
+
+    int idx = (int)(display_draw_frame - display_frames);
+    idx = __atomic_exchange_n(&display_ready, idx | FRAME_FRESH, __ATOMIC_SEQ_CST) & 3;
+    display_draw_frame = &display_frames[idx];
+    display_bitmap_base = display_draw_frame->pixels;
+
+    if (__atomic_load_n(&present_waiting, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&present_mutex);
+        pthread_cond_signal(&present_cond);
+        pthread_mutex_unlock(&present_mutex);
+    }
+}
+
+
+/*
+ *  Number of frames handed over after the one in the pixels of the frame
+ *  the VIC draws into, 0 if they are the pixels of the last frame
+ */
+
+static uint32_t display_frame_age(void)
+{
+    if (display_draw_frame->number == 0)
+    {
+        return UINT32_MAX;
+    }
+    return display_frame_count - display_draw_frame->number;
+}
+
+
+/*
+ *  Show a message over the frames, NULL to remove it
+ */
+
+static void display_message(const char *str)
+{
+    __atomic_store_n(&message_string, str, __ATOMIC_RELEASE);
+}
 
-	display_update();
 
 #ifdef FAKE_PI
-	// Calculate time between vblanks, display speedometer
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	if ((tv.tv_usec -= tv_start.tv_usec) < 0) {
-		tv.tv_usec += 1000000;
-		tv.tv_sec -= 1;
-	}
-	tv.tv_sec -= tv_start.tv_sec;
-	double elapsed_time = (double)tv.tv_sec * 1000000 + tv.tv_usec;
-	speed_index = 20000 / (elapsed_time + 1) * 100;
-
-	// Limit speed to 100%
-	if (!debug_turbo && speed_index > 100) {
-		usleep((unsigned long)(20000 - elapsed_time));
-		speed_index = 100;
-	}
+/*
+ *  Pace the replay, wait until the deadline of the frame. Deadlines are
+ *  derived from the exact number of cycles per frame of the model. A
+ *  replay far behind them (after a stall) starts over instead of running
+ *  fast to catch up
+ */
 
-	gettimeofday(&tv_start, NULL);
+template <class M> static void display_pace()
+{
+    pace_frame_ns = 1e9 * M::CYCLES_PER_LINE * M::TOTAL_RASTERS / M::CLOCK_FREQ;
+    bool throttled = !__atomic_load_n(&debug_turbo, __ATOMIC_RELAXED);
+    uint64_t now = latency_now();
 
-	static int delay = 0;
-    if (delay >= 20)
+    if (pace_start_ns == 0 || throttled != pace_throttled)
     {
-	    delay = 0;
-	    sprintf(speedometer_string, "%d%%", (int)speed_index);
+        pace_start_ns = now;
+        pace_frames = 0;
+        pace_throttled = throttled;
     }
-    else
-	{
-	    delay++;
+    else if (throttled)
+    {
+        double period = pace_frame_ns / pace_speed;
+        uint64_t deadline = pace_start_ns + (uint64_t)(++pace_frames * period);
+
+        if (now < deadline)
+        {
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000000000;
+            ts.tv_nsec = deadline % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+            uint64_t slept = latency_now() - now;
+            now += slept;
+            if (__atomic_load_n(&hud_visible, __ATOMIC_RELAXED))
+            {
+                hud_wait_ns += slept;
+            }
+        }
+        else if (now - deadline > PaceResyncFrames * period)
+        {
+            pace_start_ns = now;
+            pace_frames = 0;
+            pace_resyncs++;
+        }
+
+        uint64_t late = now > deadline ? now - deadline : 0;
+        pace_late_frames++;
+        pace_late_ns += late;
+        pace_late_sq += (double)late * late;
+        if (late > pace_late_max_ns)
+        {
+            pace_late_max_ns = late;
+        }
+    }
+
+    // Speed of the run, shown on exit
+    if (speed_start_ns == 0)
+    {
+        speed_start_ns = now;
+        return;
     }
+    speed_frames++;
+    speed_last_ns = now;
+}
+#endif
+
+
+template <class M> static void vic_vblank()
+{
+    // Frames dropped by the governor aren't presented
+    if (!vic_frame_skipped())
+    {
+        shm_frames_publish(display_draw_frame);
+        record_frame<M>(display_draw_frame);
+        display_swap();
+    }
+    governor_vblank();
+    hud_vblank<M>();
+
+#ifdef FAKE_PI
+    display_pace<M>();
 #endif
 }
 
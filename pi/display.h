@@ -17,11 +17,56 @@ static const uint32_t palette[16] =
 	0x7b7b7bff, 0xa9ff9fff, 0x706debff, 0xb2b2b2ff
 };
 
-static uint32_t *display_bitmap_base;   // Pointer to bitmap data
-static int display_bitmap_xmod;         // Number of bytes per row
+// Define to store the color index of each pixel (one byte per pixel) in the
+// bitmap, which is converted to RGBA once per presented frame
+#define INDEXED_DISPLAY
 
-static void display_update(void);
-static void display_draw_string(int x, int y, const char *str, uint32_t front_color, uint32_t back_color);
+#ifdef INDEXED_DISPLAY
+typedef uint8_t pixel_t;
+#else
+typedef uint32_t pixel_t;
+#endif
 
-static void vic_vblank();
+// The VIC draws into one frame while the present thread uploads another, the
+// third holds the last complete frame. They are swapped at vblank
+struct display_frame
+{
+	pixel_t pixels[DISPLAY_X*DISPLAY_Y];
+	uint64_t line_hash[DISPLAY_Y];	// Hash of the pixels of each line, to upload only changed lines
+	uint32_t number;				// Number of the frame in the pixels, 0 if none
+	uint64_t bus_ns, vblank_ns;		// Time of the last bus cycle and of the vblank (for latency stats)
+};
+
+static display_frame *display_draw_frame;	// Frame the VIC draws into
+static pixel_t *display_bitmap_base;    // Pointer to bitmap data
+static int display_bitmap_xmod;         // Number of pixels per row
+
+static uint32_t display_frame_age(void);
+static void display_message(const char *str);
+
+// Pixel value of a C64 color
+inline static pixel_t display_color(uint8_t color)
+{
+#ifdef INDEXED_DISPLAY
+	return color;
+#else
+	return palette[color];
+#endif
+}
+
+// Line y of the bitmap has been drawn, hash its pixels
+inline static void display_line_drawn(int y)
+{
+	const uint8_t *p = (const uint8_t *)(display_bitmap_base + display_bitmap_xmod*y);
+	uint64_t h = 0, w;
+
+	for (size_t i=0; i<DISPLAY_X*sizeof(pixel_t); i+=8) {
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+	display_draw_frame->line_hash[y] = h;
+}
+
+template <class M> static void vic_vblank();
 
@@ -2,12 +2,32 @@
 // Emulate Raspberry Pi specific code
 //
 
+#include <time.h>
+
 static const uint32_t chunck_size = 4096;
 
 uint32_t buf_len = 256*1024*1024;
 uint32_t buf_ptr;
 uint16_t *stream_buf;
 
+// Size of the DMA ring on the Pi in bus cycles (four chunks of 32760 bytes,
+// two 16-bit words per cycle)
+static const uint32_t smi_ring_cycles = 4*32760/(2*sizeof(uint16_t));
+
+// Bus cycles per second (PAL)
+static const double cycles_per_second = 985248.0;
+
+// Lowest number of cycles the DMA could write before overwriting the chunk
+// being read, since the last call of smi_headroom()
+static uint32_t min_headroom = smi_ring_cycles;
+
+// Headroom when the last chunk was fetched
+static uint32_t chunk_headroom;
+
+// Position of a pretended DMA writing the stream in real time
+static double writer_at;            // Cycles written at writer_time
+static double writer_time;
+
 static void cleanup_smi()
 {
     free(stream_buf);
@@ -15,6 +35,15 @@ static void cleanup_smi()
 
 static void cleanup_smi_and_exit(int sig)
 {
+  // Let the emulation loop return, so that the recording and the stats are
+  // finished from the normal exit path. Not after a fault, or if the loop
+  // didn't see the first request
+  bool fault = sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE || sig == SIGABRT;
+  if (!fault && !__atomic_exchange_n(&quit_requested, true, __ATOMIC_RELAXED))
+  {
+    return;
+  }
+
   printf("\nExiting with error; caught signal: %i\n", sig);
   cleanup_smi();
   exit(1);
@@ -48,23 +77,73 @@ static bool start_smi_dma()
     }
 
     buf_ptr = 0;
+
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    writer_at = 0;
+    writer_time = ts.tv_sec + ts.tv_nsec * 1e-9;
     return true;
 }
 
+//
+// Note how far a DMA writing the stream in real time would be from
+// overwriting the chunk being read
+//
+static void note_headroom()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = ts.tv_sec + ts.tv_nsec * 1e-9;
+    double read_at = buf_ptr / 2.0;
+    double chunk_cycles = chunck_size / (2*sizeof(uint16_t));
+    double written = writer_at + (now - writer_time) * cycles_per_second;
+
+    // The Pi would wait for the chunk to be written, the DMA continues from there
+    if (written < read_at + chunk_cycles)
+    {
+        writer_at = written = read_at + chunk_cycles;
+        writer_time = now;
+    }
+
+    double headroom = read_at + smi_ring_cycles - written;
+    if (headroom < 0)
+    {
+        headroom = 0;
+    }
+
+    chunk_headroom = (uint32_t)headroom;
+    if (headroom < min_headroom)
+    {
+        min_headroom = (uint32_t)headroom;
+    }
+}
+
+static uint32_t smi_headroom()
+{
+    uint32_t result = min_headroom;
+    min_headroom = smi_ring_cycles;
+    return result;
+}
+
 static uint16_t *get_next_smi_chunk()
 {
     uint16_t *result;
 
     if (buf_ptr < buf_len/sizeof(uint16_t))
     {
+        note_headroom();
         result = stream_buf + buf_ptr;
         buf_ptr += chunck_size/sizeof(uint16_t);
     }
     else
     {
-        printf("End of stream\n");
-        cleanup_smi();
-        exit(0);
+        // Let the emulation loop return, an idle bus until it does
+        static uint16_t end_of_stream[chunck_size/sizeof(uint16_t)];
+        if (!__atomic_exchange_n(&quit_requested, true, __ATOMIC_RELAXED))
+        {
+            printf("End of stream\n");
+        }
+        result = end_of_stream;
     }
 
     return result;
@@ -0,0 +1,452 @@
+/*
+ *  Headless display, the frames are written to a sink instead of a window.
+ *  This replaces display.cpp when HEADLESS is defined, so SDL isn't needed
+ *
+ *  Sinks:
+ *    null     Frames are discarded (for measuring the replay speed)
+ *    raw      RGBA bytes of each frame
+ *    indexed  Color index of each pixel (INDEXED_DISPLAY only)
+ *    y4m      YUV4MPEG2 4:4:4 stream, for video encoders
+ *    png      PNG file of every n'th frame
+ */
+
+#include <sys/time.h>
+
+enum display_sink
+{
+    SINK_NULL,
+    SINK_RAW,
+    SINK_INDEXED,
+    SINK_Y4M,
+    SINK_PNG
+};
+
+static const char *sink_names[] = {"null", "raw", "indexed", "y4m", "png"};
+
+static display_sink sink = SINK_NULL;
+static const char *sink_file;       // Output file, or prefix of the PNG files
+static uint32_t png_every = 1;      // Write every n'th frame as PNG
+static FILE *sink_out;
+
+// Frame rate as a fraction, set in the first vblank
+static uint32_t frame_rate_num, frame_rate_den;
+
+// Frames, see display.h. Frame n is drawn into display_frames[n % 3] and
+// the frames are written in order by the sink thread. The VIC only waits
+// for it when two frames are pending
+static display_frame display_frames[3];
+static uint32_t display_frame_count;    // Number of frames handed over
+static uint32_t frames_written;         // Number of frames written by the sink thread
+static uint32_t sink_waits;             // Number of frames the VIC waited for the sink
+
+// Sink thread
+static pthread_t sink_thread;
+static pthread_mutex_t sink_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sink_cond = PTHREAD_COND_INITIALIZER;
+static bool sink_quit;                  // Flag: Sink thread must exit when all frames are written
+
+static struct timeval tv_start;
+
+static void *sink_main(void *arg);
+
+
+/*
+ *  Open sink, arguments are the sink name, the file and for PNG how often
+ *  a frame is written
+ */
+
+static int display_init(int argc, char *argv[])
+{
+    if (argc > 0)
+    {
+        int i;
+        for (i=0; i<5 && strcmp(argv[0], sink_names[i]); i++);
+        if (i == 5 || argc > 3 || (i != SINK_NULL && argc < 2))
+        {
+            fprintf(stderr, "Usage: emulator_headless [pal|ntsc|ntsc-old] [shm] [record=<file>] [null|raw|indexed|y4m|png] [file or PNG prefix] [write every n'th frame as PNG]\n");
+            return 0;
+        }
+        sink = (display_sink)i;
+        sink_file = argc > 1 ? argv[1] : NULL;
+        if (argc > 2 && (png_every = atoi(argv[2])) < 1)
+        {
+            png_every = 1;
+        }
+    }
+
+#ifndef INDEXED_DISPLAY
+    if (sink == SINK_INDEXED)
+    {
+        fprintf(stderr, "The indexed sink needs INDEXED_DISPLAY\n");
+        return 0;
+    }
+#endif
+
+    if (sink != SINK_NULL && sink != SINK_PNG)
+    {
+        if ((sink_out = fopen(sink_file, "wb")) == NULL)
+        {
+            fprintf(stderr, "Failed to open %s for writing\n%s\n", sink_file, strerror(errno));
+            return 0;
+        }
+        setvbuf(sink_out, NULL, _IOFBF, 1024*1024);
+    }
+
+    display_draw_frame = &display_frames[0];
+    display_bitmap_base = display_draw_frame->pixels;
+    display_bitmap_xmod = DISPLAY_X;
+
+    if (pthread_create(&sink_thread, NULL, sink_main, NULL) != 0)
+    {
+        return 0;
+    }
+
+    gettimeofday(&tv_start, NULL);
+    return 1;
+}
+
+
+/*
+ *  Close sink, after writing the pending frames
+ */
+
+static void display_close(void)
+{
+    pthread_mutex_lock(&sink_mutex);
+    sink_quit = true;
+    pthread_cond_broadcast(&sink_cond);
+    pthread_mutex_unlock(&sink_mutex);
+    pthread_join(sink_thread, NULL);
+
+    if (sink_out != NULL)
+    {
+        fclose(sink_out);
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    double elapsed_time = (tv.tv_sec - tv_start.tv_sec) + (tv.tv_usec - tv_start.tv_usec) / 1000000.0;
+    printf("Headless: %u frames to %s sink in %.2f s (%.1f frames/s), waited %u times for the sink\n",
+        frames_written, sink_names[sink], elapsed_time, frames_written / elapsed_time, sink_waits);
+}
+
+
+/*
+ *  RGBA color of a pixel
+ */
+
+inline static uint32_t pixel_rgba(pixel_t p)
+{
+#ifdef INDEXED_DISPLAY
+    return palette[p];
+#else
+    return p;
+#endif
+}
+
+
+/*
+ *  Write frame as YUV4MPEG2 4:4:4, with the BT.601 limited range colors
+ */
+
+static void write_y4m(const display_frame *f)
+{
+    static uint8_t planes[3][DISPLAY_X*DISPLAY_Y];
+
+    if (frames_written == 0)
+    {
+        fprintf(sink_out, "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 C444\n",
+            DISPLAY_X, DISPLAY_Y, frame_rate_num, frame_rate_den);
+    }
+
+    for (int i=0; i<DISPLAY_X*DISPLAY_Y; i++)
+    {
+        uint32_t c = pixel_rgba(f->pixels[i]);
+        int r = c >> 24, g = (c >> 16) & 0xff, b = (c >> 8) & 0xff;
+
+        planes[0][i] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+        planes[1][i] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+        planes[2][i] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+    }
+
+    fputs("FRAME\n", sink_out);
+    fwrite(planes, sizeof(planes), 1, sink_out);
+}
+
+
+/*
+ *  Write frame as RGB PNG file. The image data is stored without
+ *  compression, so no zlib is needed
+ */
+
+static uint32_t png_crc_table[256];
+
+static uint32_t png_crc(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len--)
+    {
+        crc = png_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void png_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t len)
+{
+    uint8_t buf[4];
+
+    put_be32(buf, len);
+    fwrite(buf, 4, 1, file);
+    fwrite(type, 4, 1, file);
+    if (len > 0)
+    {
+        fwrite(data, len, 1, file);
+    }
+
+    uint32_t crc = png_crc(0xffffffff, (const uint8_t *)type, 4);
+    put_be32(buf, png_crc(crc, data, len) ^ 0xffffffff);
+    fwrite(buf, 4, 1, file);
+}
+
+static void write_png(const display_frame *f, uint32_t number)
+{
+    static const int ROW_BYTES = 1 + DISPLAY_X*3;          // Filter type and RGB pixels
+    static const int RAW_BYTES = ROW_BYTES*DISPLAY_Y;
+    static const int BLOCK_BYTES = 65535;                   // Largest stored deflate block
+    static uint8_t raw[RAW_BYTES];
+    static uint8_t idat[2 + RAW_BYTES + (RAW_BYTES/BLOCK_BYTES + 1)*5 + 4];
+
+    if (png_crc_table[1] == 0)
+    {
+        for (uint32_t n=0; n<256; n++)
+        {
+            uint32_t c = n;
+            for (int k=0; k<8; k++)
+            {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            png_crc_table[n] = c;
+        }
+    }
+
+    uint8_t *p = raw;
+    for (int y=0; y<DISPLAY_Y; y++)
+    {
+        *p++ = 0;   // No filter
+        for (int x=0; x<DISPLAY_X; x++)
+        {
+            uint32_t c = pixel_rgba(f->pixels[y*DISPLAY_X + x]);
+            *p++ = c >> 24;
+            *p++ = c >> 16;
+            *p++ = c >> 8;
+        }
+    }
+
+    // zlib stream of stored deflate blocks
+    uint8_t *q = idat;
+    *q++ = 0x78;
+    *q++ = 0x01;
+    uint32_t s1 = 1, s2 = 0;
+    for (int pos=0; pos<RAW_BYTES; pos+=BLOCK_BYTES)
+    {
+        int len = RAW_BYTES - pos < BLOCK_BYTES ? RAW_BYTES - pos : BLOCK_BYTES;
+        *q++ = pos + len == RAW_BYTES;
+        *q++ = len;
+        *q++ = len >> 8;
+        *q++ = ~len;
+        *q++ = ~len >> 8;
+        memcpy(q, raw + pos, len);
+        q += len;
+
+        for (int i=0; i<len; i++)
+        {
+            s1 = (s1 + raw[pos + i]) % 65521;
+            s2 = (s2 + s1) % 65521;
+        }
+    }
+    put_be32(q, (s2 << 16) | s1);
+    q += 4;
+
+    char name[256];
+    snprintf(name, sizeof(name), "%s%05u.png", sink_file, number);
+    FILE *file = fopen(name, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", name);
+        return;
+    }
+
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    uint8_t ihdr[13] = {0};
+    put_be32(ihdr, DISPLAY_X);
+    put_be32(ihdr + 4, DISPLAY_Y);
+    ihdr[8] = 8;    // Bit depth
+    ihdr[9] = 2;    // RGB
+
+    fwrite(signature, sizeof(signature), 1, file);
+    png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk(file, "IDAT", idat, q - idat);
+    png_chunk(file, "IEND", NULL, 0);
+    fclose(file);
+}
+
+
+/*
+ *  Write frame to the sink
+ */
+
+static void write_frame(const display_frame *f)
+{
+    uint32_t rgba[DISPLAY_X];
+
+    switch (sink)
+    {
+        case SINK_RAW:
+            for (int y=0; y<DISPLAY_Y; y++)
+            {
+                for (int x=0; x<DISPLAY_X; x++)
+                {
+                    put_be32((uint8_t *)&rgba[x], pixel_rgba(f->pixels[y*DISPLAY_X + x]));
+                }
+                fwrite(rgba, sizeof(rgba), 1, sink_out);
+            }
+            break;
+
+        case SINK_INDEXED:
+            fwrite(f->pixels, sizeof(f->pixels), 1, sink_out);
+            break;
+
+        case SINK_Y4M:
+            write_y4m(f);
+            break;
+
+        case SINK_PNG:
+            if (frames_written % png_every == 0)
+            {
+                write_png(f, frames_written);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+/*
+ *  Sink thread, writes the frames in the order they were handed over
+ */
+
+static void *sink_main(void *arg)
+{
+    (void)arg; // ignore
+
+    pthread_mutex_lock(&sink_mutex);
+    for (;;)
+    {
+        while (frames_written == display_frame_count && !sink_quit)
+        {
+            pthread_cond_wait(&sink_cond, &sink_mutex);
+        }
+        if (frames_written == display_frame_count)
+        {
+            break;
+        }
+
+        const display_frame *f = &display_frames[frames_written % 3];
+        pthread_mutex_unlock(&sink_mutex);
+        write_frame(f);
+        latency_presented(f);
+        latency_poll_print();
+        pthread_mutex_lock(&sink_mutex);
+
+        frames_written++;
+        pthread_cond_broadcast(&sink_cond);
+    }
+    pthread_mutex_unlock(&sink_mutex);
+
+    return NULL;
+}
+
+
+/*
+ *  Hand the frame drawn by the VIC over to the sink thread, and take the
+ *  next frame. Waits if the sink thread is still writing that one
+ */
+
+static void display_swap(void)
+{
+    display_draw_frame->number = display_frame_count + 1;
+    if (LatencyStats)
+    {
+        display_draw_frame->bus_ns = latency_bus_ns;
+        display_draw_frame->vblank_ns = latency_now();
+    }
+
+    pthread_mutex_lock(&sink_mutex);
+    display_frame_count++;
+    pthread_cond_broadcast(&sink_cond);
+    if (display_frame_count - frames_written >= 3)
+    {
+        sink_waits++;
+        do
+        {
+            pthread_cond_wait(&sink_cond, &sink_mutex);
+        } while (display_frame_count - frames_written >= 3);
+    }
+    pthread_mutex_unlock(&sink_mutex);
+
+    display_draw_frame = &display_frames[display_frame_count % 3];
+    display_bitmap_base = display_draw_frame->pixels;
+}
+
+
+/*
+ *  Number of frames handed over after the one in the pixels of the frame
+ *  the VIC draws into, 0 if they are the pixels of the last frame
+ */
+
+static uint32_t display_frame_age(void)
+{
+    if (display_draw_frame->number == 0)
+    {
+        return UINT32_MAX;
+    }
+    return display_frame_count - display_draw_frame->number;
+}
+
+
+/*
+ *  Show a message, there is no screen so it is printed
+ */
+
+static void display_message(const char *str)
+{
+    if (str != NULL)
+    {
+        printf("%s\n", str);
+    }
+}
+
+
+template <class M> static void vic_vblank()
+{
+    frame_rate_num = M::CLOCK_FREQ;
+    frame_rate_den = M::CYCLES_PER_LINE * M::TOTAL_RASTERS;
+
+    // Frames dropped by the governor aren't written
+    if (!vic_frame_skipped())
+    {
+        shm_frames_publish(display_draw_frame);
+        record_frame<M>(display_draw_frame);
+        display_swap();
+    }
+    governor_vblank();
+}
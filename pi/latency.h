@@ -0,0 +1,141 @@
+/*
+ *  Latency from a cycle on the C64 bus to the screen, in stages
+ *
+ *  A bus cycle is written to a chunk by the DMA (fill), the chunk waits in
+ *  the ring until it is read (ring), the line of the cycle is emulated
+ *  (emulate) and drawn (render), and the frame is presented at last
+ *  (present, from vblank). Total is from the last bus cycle of a frame
+ *  until it is presented
+ */
+
+// Latencies are measured, they are printed on exit and on SIGUSR1. Off by
+// default, it reads the clock and updates the shared histograms every line
+static const bool LatencyStats = false;
+
+enum latency_stage
+{
+	LAT_FILL,
+	LAT_RING,
+	LAT_EMULATE,
+	LAT_RENDER,
+	LAT_PRESENT,
+	LAT_TOTAL,
+	LAT_STAGES
+};
+
+static const char *latency_stage_names[LAT_STAGES] =
+{
+	"DMA fill", "Ring lag", "Emulate", "Render", "Present", "Total"
+};
+
+// Histogram buckets, 1 us wide below 16 us and 16 per power of two above
+static const int LATENCY_BUCKETS = 16*29;
+
+struct latency_histogram
+{
+	uint32_t count[LATENCY_BUCKETS];
+	uint32_t samples;
+	uint32_t max_us;
+};
+
+static latency_histogram latency_hist[LAT_STAGES];
+static bool latency_print_requested;	// Flag: SIGUSR1 received
+static double latency_cycle_ns;			// Duration of a bus cycle of the model
+static uint64_t latency_bus_ns;			// Time of the last bus cycle of the last emulated line
+
+// Monotonic time in nanoseconds
+inline static uint64_t latency_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+inline static int latency_bucket(uint32_t us)
+{
+	if (us < 16)
+		return us;
+
+	int e = 31 - __builtin_clz(us);		// 4..31
+	int idx = 16*(e-3) + ((us >> (e-4)) & 15);
+	return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS-1;
+}
+
+// Highest latency of a bucket in us
+inline static uint32_t latency_bucket_us(int idx)
+{
+	if (idx < 16)
+		return idx;
+
+	int e = idx/16 + 3;
+	return (((uint32_t)(16 + idx%16 + 1) << (e-4))) - 1;
+}
+
+// Add a sample, may be called from any thread
+inline static void latency_add(latency_stage stage, int64_t ns)
+{
+	latency_histogram *h = &latency_hist[stage];
+	uint32_t us = ns > 0 ? (uint32_t)(ns/1000 < UINT32_MAX ? ns/1000 : UINT32_MAX) : 0;
+
+	__atomic_add_fetch(&h->count[latency_bucket(us)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->samples, 1, __ATOMIC_RELAXED);
+
+	uint32_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// Latency not exceeded by the fraction q of the samples
+static uint32_t latency_percentile(const latency_histogram *h, double q)
+{
+	uint32_t samples = __atomic_load_n(&h->samples, __ATOMIC_RELAXED);
+	uint32_t n = 0;
+
+	for (int i=0; i<LATENCY_BUCKETS; i++) {
+		n += __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+		if (n >= q*samples && n > 0) {
+			uint32_t us = latency_bucket_us(i);
+			return us < h->max_us ? us : h->max_us;
+		}
+	}
+	return 0;
+}
+
+static void latency_print(void)
+{
+	if (!LatencyStats)
+		return;
+
+	printf("Latency (us)    samples      p50      p99      max\n");
+	for (int s=0; s<LAT_STAGES; s++) {
+		const latency_histogram *h = &latency_hist[s];
+		printf("%-12s %10u %8u %8u %8u\n", latency_stage_names[s], h->samples,
+			latency_percentile(h, 0.5), latency_percentile(h, 0.99), h->max_us);
+	}
+	fflush(stdout);
+}
+
+// A frame has been presented, or written by the sink
+static void latency_presented(const display_frame *f)
+{
+	if (!LatencyStats || f->number == 0)
+		return;
+
+	uint64_t now = latency_now();
+	latency_add(LAT_PRESENT, now - f->vblank_ns);
+	if (f->bus_ns)	// Not before the first line was emulated
+		latency_add(LAT_TOTAL, now - f->bus_ns);
+}
+
+// Print the stats if requested, called by the thread presenting the frames
+static void latency_poll_print(void)
+{
+	if (LatencyStats && __atomic_exchange_n(&latency_print_requested, false, __ATOMIC_RELAXED))
+		latency_print();
+}
+
+static void latency_request_print(int sig)
+{
+	(void)sig;	// ignore
+	latency_print_requested = true;
+}
@@ -5,44 +5,137 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <sys/resource.h>
+#include <pthread.h>
+#include <time.h>
 #include "display.h"
 #include "6581.h"
 #include "pi.h"
+#include "latency.h"
 
 #include "6502.cpp"
 
 #undef FAKE_PI
 //#define FAKE_PI
 
+// HEADLESS is defined when building emulator_headless, which writes the
+// frames to a sink (see headless.cpp) instead of a window and has no sound
+
 // CPU cycle counter
 static uint32_t cycle_counter;
 
 static uint8_t ram[0x10000];
+static uint32_t ram_dirty[0x100/32];    // One bit per 256 byte page of RAM written in this frame
 static uint8_t color_ram[0x0400];
 static uint8_t char_rom[0x1000];
 
 // VIC-II stuff
 static bool vic_ba_Low;
-static bool vic_in_sync = false;
+static bool vic_in_sync = false;    // Flag: The emulated VIC-II is phase locked to the real one
+
+// VIC-II phase lock. While not locked, the emulated VIC-II is held (not
+// clocked) when its BA is low and BA in the bus stream is high, until both
+// are low in the same cycle. While locked, the falling edges of the emulated
+// BA are paired with the edges in the stream. When several pairs in a row
+// show the same phase offset, the VIC-II is held or clocked extra cycles to
+// correct it. The lock is dropped if BA differs in too many cycles of a frame
+static const uint32_t SyncMaxMismatches = 8;    // BA mismatches in a frame that drop the lock
+static const uint32_t SyncEdgeWindow = 31;      // Max. cycles between paired BA edges
+static const int SyncEdgePairs = 3;             // Pairs with the same offset before correcting it
+
+static uint32_t sync_locks;                     // Number of times the lock was acquired
+static uint32_t sync_losses;                    // Number of times the lock was dropped
+static uint32_t sync_corrections;               // Number of phase corrections while locked
+static uint32_t sync_held_cycles;               // Cycles the VIC-II was held
+static uint32_t sync_mismatches;                // Cycles with BA mismatch while locked
+static uint32_t sync_frame_mismatches;
+static int sync_lines;                          // Lines emulated in the current check frame
+
+static bool sync_last_ba, sync_last_vic_ba;     // BA in the last cycle (stream, emulated)
+static bool sync_stream_edge, sync_vic_edge;    // Flags: Falling edge not paired yet
+static uint32_t sync_stream_cycle, sync_vic_cycle;  // Cycles of the last falling edges
+static int32_t sync_offset;                     // Phase offset of the last pairs (> 0: VIC-II late)
+static int sync_offset_pairs;                   // Number of pairs in a row with this offset
+static uint32_t sync_hold;                      // Cycles left to hold the VIC-II
+
+static bool vic_irq = false;
+static uint32_t vic_irq_cycle;      // Cycle the VIC-II asserted IRQ
+
+static void vic_trigger_irq_at(uint32_t at_cycle)
+{
+    if (!vic_irq || (int32_t)(at_cycle - vic_irq_cycle) < 0)
+    {
+        vic_irq = true;
+        vic_irq_cycle = at_cycle;
+    }
+}
 
 static void vic_trigger_irq()
 {
-    // Ignore
+    vic_trigger_irq_at(cycle_counter);
 }
 
 static void vic_clear_irq()
 {
-    // Ignore
+    vic_irq = false;
 }
 
 static bool quit_requested = false;
+#ifndef HEADLESS
 static bool debug_turbo = true;
+#endif
+
+// Frame skipping governor. When the DMA is about to overwrite data not read
+// yet, the pixels of whole frames are dropped until there is headroom again
+static const int GovernorRestoreFrames = 25;    // Frames with headroom before drawing again
+static uint32_t frames_skipped;                 // Number of frames not drawn
+static uint32_t governor_headroom;              // Lowest DMA headroom in the last frame (in cycles)
+static uint32_t governor_min_headroom = UINT32_MAX; // Lowest DMA headroom so far
+static int governor_calm_frames;
+
+static void governor_vblank();
+
+// Performance HUD, toggled in the window. The time spent on the emulation
+// thread is only measured while the HUD is shown
+struct hud_stats
+{
+    uint32_t cycles_per_sec;        // Emulated cycles per second
+    double speed;                   // In percent of the C64
+    uint32_t headroom;              // DMA headroom in cycles...
+    double headroom_chunks;         // ... and in chunks
+    uint32_t cpu, vic, wait;        // Time of the emulation thread in percent
+    uint32_t sid;                   // Synthesis time in percent of the audio made
+    uint32_t frames_skipped;
+    bool in_sync;
+    uint32_t sync_losses;
+};
+
+static bool hud_visible;                        // Flag: HUD is shown
+static uint64_t hud_vic_ns, hud_wait_ns;        // Time drawing lines and waiting for the DMA
+static uint64_t hud_sid_ns, hud_audio_ns;       // Time synthesizing on the audio thread, and the audio made
+static hud_stats hud_snapshot;                  // Last stats, for the present thread
+static uint32_t hud_snapshot_count;             // Number of snapshots taken
+static pthread_mutex_t hud_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+template <class M> static void hud_vblank();
 
 #include "6569.cpp"
-#include "sound.cpp"
+#ifndef HEADLESS
+  #include "sound.cpp"
+#else
+  #include "sound_none.cpp"
+#endif
 #include "6581.cpp"
-#include "display.cpp"
+#include "6526.cpp"
+#include "shm_frames.cpp"
+#include "record.cpp"
+#ifndef HEADLESS
+  #include "display.cpp"
+#else
+  #include "headless.cpp"
+#endif
 
 #ifndef FAKE_PI
   #include "pi.cpp"
@@ -50,99 +143,517 @@ static bool debug_turbo = true;
   #include "fake_pi.cpp"
 #endif
 
+// Called in vblank, decides if the next frame is drawn
+static void governor_vblank()
+{
+    if (vic_frame_skipped())
+    {
+        frames_skipped++;
+    }
+
+    governor_headroom = smi_headroom();
+    if (governor_headroom < governor_min_headroom)
+    {
+        governor_min_headroom = governor_headroom;
+    }
+
+    if (governor_headroom < smi_ring_cycles/4)
+    {
+        governor_calm_frames = 0;
+        vic_skip_frame(true);
+    }
+    else if (governor_headroom < smi_ring_cycles/2)
+    {
+        governor_calm_frames = 0;
+    }
+    else if (vic_frame_skipped() && ++governor_calm_frames >= GovernorRestoreFrames)
+    {
+        vic_skip_frame(false);
+    }
+}
+
+// Called in vblank, takes a snapshot of the stats for the HUD twice a second
+template <class M> static void hud_vblank()
+{
+    static uint64_t start_ns;           // Start of the measurement, 0 if none
+    static uint32_t start_cycle;
+
+    if (!__atomic_load_n(&hud_visible, __ATOMIC_RELAXED))
+    {
+        start_ns = 0;
+        return;
+    }
+
+    uint64_t now = latency_now();
+    if (start_ns && now - start_ns >= 500000000)
+    {
+        double elapsed = now - start_ns;
+        uint64_t busy = hud_vic_ns + hud_wait_ns;
+        uint64_t sid_ns = __atomic_load_n(&hud_sid_ns, __ATOMIC_RELAXED);
+        uint64_t audio_ns = __atomic_load_n(&hud_audio_ns, __ATOMIC_RELAXED);
+        hud_stats s;
+
+        s.cycles_per_sec = (uint32_t)((cycle_counter - start_cycle) * 1e9 / elapsed);
+        s.speed = s.cycles_per_sec * 100.0 / M::CLOCK_FREQ;
+        s.headroom = governor_headroom;
+        s.headroom_chunks = (double)governor_headroom / (chunck_size/(2*sizeof(uint16_t)));
+        s.cpu = busy < elapsed ? (uint32_t)((elapsed - busy) * 100 / elapsed + 0.5) : 0;
+        s.vic = (uint32_t)(hud_vic_ns * 100 / elapsed + 0.5);
+        s.sid = audio_ns ? (uint32_t)(sid_ns * 100.0 / audio_ns + 0.5) : 0;
+        s.wait = (uint32_t)(hud_wait_ns * 100 / elapsed + 0.5);
+        s.frames_skipped = frames_skipped;
+        s.in_sync = vic_in_sync;
+        s.sync_losses = sync_losses;
+
+        pthread_mutex_lock(&hud_mutex);
+        hud_snapshot = s;
+        hud_snapshot_count++;
+        pthread_mutex_unlock(&hud_mutex);
+    }
+    else if (start_ns)
+    {
+        return;
+    }
+
+    start_ns = now;
+    start_cycle = cycle_counter;
+    hud_vic_ns = hud_wait_ns = 0;
+    __atomic_store_n(&hud_sid_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hud_audio_ns, 0, __ATOMIC_RELAXED);
+}
+
 static uint8_t ddr_6510 = 0x00;
 static uint8_t dr_6510 = 0x3f;
-static bool io_visible = false;
+
+inline static void cia2_changed_va()
+{
+	// VA14/15
+    changed_va_6569(~(cia2.pra | ~cia2.ddra) & 3);
+}
+
+// Cartridge lines (active low). The interface doesn't capture /EXROM and
+// /GAME, so they are inactive unless set by cartridge_changed_lines()
+static bool exrom_line = true;
+static bool game_line = true;
+
+// Memory map, one read and one write handler per 256 byte page.
+// Read handlers get the data seen on the bus and return the value the CPU reads
+typedef uint8_t (*mem_read_handler)(uint16_t address, uint8_t data);
+typedef void (*mem_write_handler)(uint16_t address, uint8_t data);
+
+static mem_read_handler mem_read_table[0x100];
+static mem_write_handler mem_write_table[0x100];
+static int mem_config = -1;     // Current PLA configuration (LORAM/HIRAM/CHAREN/GAME/EXROM)
+
+static uint8_t bus_read(uint16_t address, uint8_t data)
+{
+    (void)address;
+    return data;
+}
+
+static void ram_write(uint16_t address, uint8_t data)
+{
+    if (ram[address] != data)
+    {
+        ram[address] = data;
+
+        uint32_t bit = 1 << ((address >> 8) & 0x1f);
+        if (!(ram_dirty[address >> 13] & bit))
+        {
+            ram_dirty[address >> 13] |= bit;
+            changed_page_6569(address >> 8);
+        }
+    }
+}
+
+static void open_write(uint16_t address, uint8_t data)
+{
+    // Unmapped (Ultimax mode) or cartridge ROM, ignore
+    (void)address;
+    (void)data;
+}
+
+static uint8_t vic_read(uint16_t address, uint8_t data)
+{
+    return read_register_6569(address & 0x3f, data);
+}
+
+static void vic_write(uint16_t address, uint8_t data)
+{
+    write_register_6569(address & 0x3f, data);
+}
+
+static void sid_write(uint16_t address, uint8_t data)
+{
+    write_register_6581(address & 0x1f, data);
+}
+
+static void color_ram_write(uint16_t address, uint8_t data)
+{
+    if (color_ram[address & 0x03ff] != (data & 0x0f))
+    {
+        color_ram[address & 0x03ff] = data & 0x0f;
+        changed_color_ram_6569();
+    }
+}
+
+static uint8_t cia1_read(uint16_t address, uint8_t data)
+{
+    return read_register_6526(&cia1, address & 0x0f, data);
+}
+
+static void cia1_write(uint16_t address, uint8_t data)
+{
+    write_register_6526(&cia1, address & 0x0f, data);
+}
+
+static uint8_t cia2_read(uint16_t address, uint8_t data)
+{
+    return read_register_6526(&cia2, address & 0x0f, data);
+}
+
+static void cia2_write(uint16_t address, uint8_t data)
+{
+    write_register_6526(&cia2, address & 0x0f, data);
+
+    address &= 0x0f;
+    if (address == 0x0 || address == 0x2)
+    {
+        cia2_changed_va();
+    }
+}
+
+// What the PLA maps into a 4K region
+enum {
+    MAP_RAM,
+    MAP_BASIC,
+    MAP_KERNAL,
+    MAP_CHAR,
+    MAP_IO,
+    MAP_ROML,
+    MAP_ROMH,
+    MAP_ULTIMAX_ROM,    // ROML or ROMH in Ultimax mode, no RAM below
+    MAP_OPEN
+};
+
+static void map_region(uint8_t first_page, uint8_t last_page, int map)
+{
+    for (int page = first_page; page <= last_page; page++)
+    {
+        mem_read_table[page] = bus_read;
+
+        switch (map)
+        {
+            case MAP_IO:
+                switch (page & 0x0f)
+                {
+                    case 0x0:   // VIC
+                    case 0x1:
+                    case 0x2:
+                    case 0x3:
+                        mem_read_table[page] = vic_read;
+                        mem_write_table[page] = vic_write;
+                        break;
+                    case 0x4:   // SID
+                    case 0x5:
+                    case 0x6:
+                    case 0x7:
+                        mem_write_table[page] = sid_write;
+                        break;
+                    case 0x8:   // Color RAM
+                    case 0x9:
+                    case 0xa:
+                    case 0xb:
+                        mem_write_table[page] = color_ram_write;
+                        break;
+                    case 0xc:   // CIA 1
+                        mem_read_table[page] = cia1_read;
+                        mem_write_table[page] = cia1_write;
+                        break;
+                    case 0xd:   // CIA 2
+                        mem_read_table[page] = cia2_read;
+                        mem_write_table[page] = cia2_write;
+                        break;
+                    default:    // I/O 1, I/O 2
+                        mem_write_table[page] = open_write;
+                        break;
+                }
+                break;
+
+            // Writes to ROM goes to the RAM below, also with a cartridge
+            case MAP_RAM:
+            case MAP_BASIC:
+            case MAP_KERNAL:
+            case MAP_CHAR:
+            case MAP_ROML:
+            case MAP_ROMH:
+                mem_write_table[page] = ram_write;
+                break;
+
+            // Writes to cartridge ROM in Ultimax mode and unmapped areas are lost
+            default:
+                mem_write_table[page] = open_write;
+                break;
+        }
+    }
+}
+
+//
+// Rebuild memory map from the 6510 port and the cartridge lines.
+// Implements all 32 configurations of the PLA
+//
+static void pla_changed_config(uint8_t port)
+{
+    bool loram = port & 0x01;
+    bool hiram = port & 0x02;
+    bool charen = port & 0x04;
+    int config = (port & 0x07) | (game_line << 3) | (exrom_line << 4);
+
+    if (config == mem_config)
+    {
+        return;
+    }
+    mem_config = config;
+
+    if (exrom_line && !game_line)
+    {
+        // Ultimax mode, the port is ignored
+        map_region(0x00, 0x0f, MAP_RAM);
+        map_region(0x10, 0x7f, MAP_OPEN);
+        map_region(0x80, 0x9f, MAP_ULTIMAX_ROM);
+        map_region(0xa0, 0xcf, MAP_OPEN);
+        map_region(0xd0, 0xdf, MAP_IO);
+        map_region(0xe0, 0xff, MAP_ULTIMAX_ROM);
+        return;
+    }
+
+    map_region(0x00, 0x7f, MAP_RAM);
+
+    if (!exrom_line && loram && hiram)
+        map_region(0x80, 0x9f, MAP_ROML);
+    else
+        map_region(0x80, 0x9f, MAP_RAM);
+
+    if (!exrom_line && !game_line && hiram)
+        map_region(0xa0, 0xbf, MAP_ROMH);
+    else if (game_line && loram && hiram)
+        map_region(0xa0, 0xbf, MAP_BASIC);
+    else
+        map_region(0xa0, 0xbf, MAP_RAM);
+
+    map_region(0xc0, 0xcf, MAP_RAM);
+
+    // A 16K cartridge needs HIRAM to see I/O or character ROM
+    if (game_line ? !(loram || hiram) : !hiram && !(charen && loram))
+        map_region(0xd0, 0xdf, MAP_RAM);
+    else if (charen)
+        map_region(0xd0, 0xdf, MAP_IO);
+    else
+        map_region(0xd0, 0xdf, MAP_CHAR);
+
+    map_region(0xe0, 0xff, hiram ? MAP_KERNAL : MAP_RAM);
+}
 
 inline static void cpu_changed_port()
 {
     uint8_t port = ~ddr_6510 | dr_6510;
-    io_visible = (port & 0x03) && (port & 0x04);
+    pla_changed_config(port);
 }
 
-static uint8_t pra_6526_2 = 0x00;
-static uint8_t ddra_6526_2 = 0x00;
-
-inline static void cia2_changed_va()
+inline static void cartridge_changed_lines(bool exrom, bool game)
 {
-	// VA14/15
-    changed_va_6569(~(pra_6526_2 | ~ddra_6526_2) & 3);
+    exrom_line = exrom;
+    game_line = game;
+    cpu_changed_port();
 }
 
-static void reset6526_2()
+// Interrupt prediction. The CPU samples the interrupt lines before the
+// penultimate cycle of an instruction
+static uint32_t step_cycle[4];      // Cycles of the last CPU steps, most recent first
+static uint8_t step_count;          // CPU steps since the start of the last instruction
+static uint8_t last_opcode, last_status;
+static bool nmi_taken = false;
+static uint32_t nmi_cycle;          // Cycle the last NMI taken was asserted
+
+// Interrupts from sources that are not emulated (RESTORE key, cartridges, the
+// serial port) can only be detected by looking ahead in the bus stream
+static const bool InterruptLookAhead = true;
+static uint32_t interrupts_predicted, interrupts_seen;
+
+static bool interrupt_predicted()
 {
-	pra_6526_2 = 0;
-	ddra_6526_2 = 0;
-	cia2_changed_va();
+    // A taken branch that doesn't cross a page samples one cycle earlier
+    uint32_t poll = step_cycle[2];
+    if ((last_opcode & 0x1f) == 0x10 && step_count == 3)
+    {
+        poll = step_cycle[3];
+    }
+
+    // NMI is edge triggered
+    if (irq_asserted_6526(&cia2, poll) && !(nmi_taken && nmi_cycle == cia2.irq_cycle))
+    {
+        nmi_taken = true;
+        nmi_cycle = cia2.irq_cycle;
+        return true;
+    }
+
+    // CLI, SEI and PLP change the I flag after the lines are sampled,
+    // unless the CPU was stalled by the VIC-II in the last cycle
+    uint8_t status = cpu.status;
+    if ((last_opcode == 0x58 || last_opcode == 0x78 || last_opcode == 0x28) &&
+        step_cycle[1] - step_cycle[2] == 1)
+    {
+        status = last_status;
+    }
+
+    if (status & FLAG_INTERRUPT)
+    {
+        return false;
+    }
+
+    if (vic_irq && vic_in_sync && (int32_t)(poll - vic_irq_cycle) >= 0)
+    {
+        return true;
+    }
+
+    return irq_asserted_6526(&cia1, poll);
 }
 
-static void reset_sim()
+template <class M> static void reset_sim()
 {
     cycle_counter = -1;
+    mains_period = M::CLOCK_FREQ / M::MAINS_FREQ;
+    latency_cycle_ns = 1e9 / M::CLOCK_FREQ;
     ddr_6510 = 0x00;
     dr_6510 = 0x3f;
     cpu_changed_port();
     reset6502();
 
-    reset6526_2();
-    reset6569();
+    reset6526(&cia1);
+    reset6526(&cia2);
+    cia2_changed_va();
+    vic_irq = false;
+    reset6569<M>();
     reset6581();
 }
 
-static void write_register_6526_2(uint8_t address, uint8_t data)
+// Clock the emulated VIC-II, returns true if a new line has started
+template <class M> inline static bool clock_vic()
 {
-	switch (address)
-	{
-        case 0x0:
-            pra_6526_2 = data;
-            cia2_changed_va();
-            break;
-        case 0x2:
-            ddra_6526_2 = data;
-            cia2_changed_va();
-            break;
+    if (!emulate_cycle_6569<M>())
+    {
+        return false;
     }
+
+    emulate_line_6581();
+
+    // Keep the lazily evaluated CIA state within range of the cycle counter
+    update_6526(&cia1, cycle_counter);
+    update_6526(&cia2, cycle_counter);
+    return true;
 }
 
-static void mem_write(uint16_t address, uint8_t data)
+// Pair the falling edges of the emulated BA and BA in the stream, correct
+// the phase when enough pairs agree on an offset. Returns the number of
+// lines started by the cycles clocked to catch up
+template <class M> static int vic_sync_edges(bool ba)
 {
-    if (address < 0xd000 || address >= 0xe000 || !io_visible)
+    if (ba && !sync_last_ba)
     {
-        ram[address] = data;
+        sync_stream_edge = true;
+        sync_stream_cycle = cycle_counter;
+    }
+    if (vic_ba_Low && !sync_last_vic_ba)
+    {
+        sync_vic_edge = true;
+        sync_vic_cycle = cycle_counter;
+    }
+    sync_last_ba = ba;
+    sync_last_vic_ba = vic_ba_Low;
+
+    // Edges without a partner within the window are dropped
+    if (sync_stream_edge && cycle_counter - sync_stream_cycle > SyncEdgeWindow)
+    {
+        sync_stream_edge = false;
+    }
+    if (sync_vic_edge && cycle_counter - sync_vic_cycle > SyncEdgeWindow)
+    {
+        sync_vic_edge = false;
+    }
+    if (!sync_stream_edge || !sync_vic_edge || sync_hold)
+    {
+        return 0;
+    }
+
+    int32_t offset = (int32_t)(sync_vic_cycle - sync_stream_cycle);
+    sync_stream_edge = sync_vic_edge = false;
+    if (offset != sync_offset)
+    {
+        sync_offset = offset;
+        sync_offset_pairs = 0;
+    }
+    if (offset == 0 || ++sync_offset_pairs < SyncEdgePairs)
+    {
+        return 0;
+    }
+
+    // Hold the VIC-II if it is early, catch up if it is late
+    int lines = 0;
+    sync_corrections++;
+    sync_offset = sync_offset_pairs = 0;
+    if (offset < 0)
+    {
+        sync_hold = -offset;
     }
     else
     {
-		switch ((address >> 8) & 0x0f)
-		{
-			case 0x0:	// VIC
-			case 0x1:
-			case 0x2:
-			case 0x3:
-				write_register_6569(address & 0x3f, data);
-				break;
-			case 0x4:	// SID
-			case 0x5:
-			case 0x6:
-			case 0x7:
-				write_register_6581(address & 0x1f, data);
-				break;
-			case 0x8:	// Color RAM
-			case 0x9:
-			case 0xa:
-			case 0xb:
-				color_ram[address & 0x03ff] = data & 0x0f;
-				break;
-			case 0xc:	// CIA 1
-				break;
-			case 0xd:	// CIA 2
-				write_register_6526_2(address & 0x0f, data);
-				break;
-			case 0xe:	// I/O 1
-                break;
-			case 0xf:	// I/O 2
-				break;
-		}
-	}
+        while (offset--)
+        {
+            lines += clock_vic<M>();
+        }
+    }
+    return lines;
+}
+
+// A line has started, drop the lock after a frame with too many
+// mismatches (the VIC-II is locked again in the main loop)
+template <class M> inline static void vic_sync_line(void)
+{
+    if (++sync_lines == M::TOTAL_RASTERS)
+    {
+        if (sync_frame_mismatches > SyncMaxMismatches)
+        {
+            vic_in_sync = false;
+            sync_losses++;
+        }
+        sync_lines = 0;
+        sync_frame_mismatches = 0;
+    }
+}
+
+// Compare the emulated BA with the stream
+template <class M> inline static void vic_sync_check(bool ba, bool new_line)
+{
+    if (vic_ba_Low != ba)
+    {
+        sync_mismatches++;
+        sync_frame_mismatches++;
+    }
+
+    if (new_line)
+    {
+        vic_sync_line<M>();
+    }
+}
+
+inline static uint8_t mem_read(uint16_t address, uint8_t data)
+{
+    return mem_read_table[address >> 8](address, data);
+}
+
+inline static void mem_write(uint16_t address, uint8_t data)
+{
+    mem_write_table[address >> 8](address, data);
 }
 
 struct smi_stream
@@ -150,23 +661,74 @@ struct smi_stream
     uint16_t *chunk_at;
     uint32_t remaining;
     uint16_t *next_chunk;
+
+    // Estimated time the DMA completed the chunk, and time it was fetched
+    uint64_t done_ns, fetch_ns;
+    uint64_t next_done_ns, next_fetch_ns;
 };
 
+// Fetch the next chunk from the DMA ring. The time the DMA completed it is
+// estimated from the cycles written since, and the fetch time
+static uint16_t *fetch_chunk(uint64_t *done_ns, uint64_t *fetch_ns)
+{
+    uint64_t start = __atomic_load_n(&hud_visible, __ATOMIC_RELAXED) ? latency_now() : 0;
+    uint16_t *chunk = get_next_smi_chunk();
+    if (start)
+    {
+        hud_wait_ns += latency_now() - start;
+    }
+
+    if (LatencyStats)
+    {
+        int32_t lag = smi_ring_cycles - chunck_size/(2*sizeof(uint16_t)) - chunk_headroom;
+        *fetch_ns = latency_now();
+        *done_ns = *fetch_ns - (uint64_t)(lag > 0 ? lag * latency_cycle_ns : 0);
+        latency_add(LAT_RING, *fetch_ns - *done_ns);
+    }
+    return chunk;
+}
+
 static void get_next_chunk(smi_stream *stream)
 {
     if (stream->next_chunk)
     {
         stream->chunk_at = stream->next_chunk;
         stream->next_chunk = 0;
+        stream->done_ns = stream->next_done_ns;
+        stream->fetch_ns = stream->next_fetch_ns;
     }
     else
     {
-        stream->chunk_at = get_next_smi_chunk();
+        stream->chunk_at = fetch_chunk(&stream->done_ns, &stream->fetch_ns);
     }
 
     stream->remaining = chunck_size/sizeof(uint16_t);
 }
 
+// A raster line has been emulated, the stream is at its last bus cycle
+static void latency_line(const smi_stream *stream)
+{
+    uint64_t bus_ns = stream->done_ns - (uint64_t)(stream->remaining/2 * latency_cycle_ns);
+
+    latency_add(LAT_FILL, stream->done_ns - bus_ns);
+    latency_add(LAT_EMULATE, latency_now() - stream->fetch_ns);
+    latency_bus_ns = bus_ns;
+}
+
+// Lines started while catching up in a phase correction are counted like
+// the others
+template <class M> static void vic_sync_caught_up(const smi_stream *stream, int lines)
+{
+    while (lines--)
+    {
+        if (LatencyStats)
+        {
+            latency_line(stream);
+        }
+        vic_sync_line<M>();
+    }
+}
+
 static uint16_t get(smi_stream *stream)
 {
     uint16_t result = *stream->chunk_at++;
@@ -188,7 +750,7 @@ static uint16_t peek(smi_stream *stream, uint32_t pos)
         pos -= stream->remaining;
         if (!stream->next_chunk)
         {
-            stream->next_chunk = get_next_smi_chunk();
+            stream->next_chunk = fetch_chunk(&stream->next_done_ns, &stream->next_fetch_ns);
         }
 
         result = stream->next_chunk[pos];
@@ -201,47 +763,14 @@ static uint16_t peek(smi_stream *stream, uint32_t pos)
     return result;
 }
 
-int main()
+// Emulation of a C64 with the VIC-II model M, until quit or the bus
+// stream can't be followed
+template <class M> static int run(void)
 {
-    // Catch all signals (like ctrl+c, ctrl+z, ...) to ensure DMA is disabled
-    for (int i = 0; i < 64; i++)
-    {
-        struct sigaction sa;
-        memset(&sa, 0, sizeof(sa));
-        sa.sa_handler = cleanup_smi_and_exit;
-        sigaction(i, &sa, NULL);
-    }
+    init6581<M>();
+    sound_init<M>();
 
-    id_t pid = getpid();  
-    setpriority(PRIO_PROCESS, pid, -20);
-
-    FILE *rom_file = fopen("char.rom", "r");
-    if (rom_file != NULL)
-    {
-        if (fread(char_rom, sizeof(char_rom), 1, rom_file) != 1)
-        {
-            fprintf(stderr, "Failed to read data from char.rom file\n");
-            return 1;
-        }
-        fclose(rom_file);
-    }
-    else
-    {
-        fprintf(stderr, "Failed to open char.rom file for reading\n%s\n",
-            strerror(errno));
-        return 1;
-    }
-
-	if (!display_init())
-    {
-        fprintf(stderr, "Failed to init display\n");
-        return 1;
-    }
-
-    init6581();
-    sound_init();
-
-    reset_sim();
+    reset_sim<M>();
     bool interrupt = false;
 
     if (!start_smi_dma())
@@ -251,17 +780,18 @@ int main()
         return 1;
     }
 
-    display_draw_string(96, 120, "WAITING FOR C64 TO RESET", palette[14], palette[0]);
-    display_update();
+    display_message("WAITING FOR C64 TO RESET");
 
     smi_stream stream = {};
     get_next_chunk(&stream);
 
     // Wait for reset
-    while (peek(&stream, 0) != 0xFFFC || peek(&stream, 2) != 0xFFFD)
+    while ((peek(&stream, 0) != 0xFFFC || peek(&stream, 2) != 0xFFFD) &&
+        !__atomic_load_n(&quit_requested, __ATOMIC_RELAXED))
     {
         get(&stream);
     }
+    display_message(NULL);
 
     for (cycle_counter=0;; cycle_counter++)
     {
@@ -300,35 +830,74 @@ int main()
             }
         }
 
-        // Look ahead to detect interrupt -
-        // 3 consecutive writes only occur during an interrupt or BRK
-        if (!interrupt && cpu.cycle == 1 && (peek(&stream, 1) & 0x0100) &&
-            (peek(&stream, 3) & 0x0100) && (peek(&stream, 5) & 0x0100))
+        // Check for interrupt at the start of an instruction (not stalled by the VIC-II)
+        if (!interrupt && cpu.cycle == 1 && !ba)
         {
-            if (cpu.opcode != 0x00) // Check for BRK instruction
+            if (interrupt_predicted())
+            {
+                interrupt = true;
+                interrupts_predicted++;
+            }
+            // Look ahead to detect interrupt -
+            // 3 consecutive writes only occur during an interrupt or BRK
+            else if (InterruptLookAhead && (peek(&stream, 1) & 0x0100) &&
+                (peek(&stream, 3) & 0x0100) && (peek(&stream, 5) & 0x0100) &&
+                cpu.opcode != 0x00) // Check for BRK instruction
+            {
+                interrupt = true;
+                interrupts_seen++;
+            }
+
+            last_opcode = interrupt ? 0x00 : cpu.opcode;
+            last_status = cpu.status;
+            step_count = 0;
+
+            if (interrupt)
             {
                 cpu.opcode = 0x00;
                 cpu.addr = --cpu.pc;
                 --cpu.pc;
-                interrupt = true;
             }
         }
 
-        // TODO: Improve the VIC-II sync
-        if (vic_in_sync || !vic_ba_Low)
+        if (sync_hold)
+        {
+            // Phase correction, the VIC-II is early
+            sync_hold--;
+            sync_held_cycles++;
+            vic_sync_caught_up<M>(&stream, vic_sync_edges<M>(ba));
+        }
+        else if (vic_in_sync || !vic_ba_Low)
         {
-    		if (emulate_cycle_6569())
-    		{
-    			emulate_line_6581();
-			}
+            bool new_line = clock_vic<M>();
+
+            if (LatencyStats && new_line)
+            {
+                latency_line(&stream);
+            }
+
+            if (vic_in_sync)
+            {
+                vic_sync_check<M>(ba, new_line);
+                vic_sync_caught_up<M>(&stream, vic_sync_edges<M>(ba));
+            }
         }
         else if (ba)
         {
             // The VIC-II emulator is in sync with the real C64
             vic_in_sync = true;
+            sync_locks++;
+            sync_lines = 0;
+            sync_frame_mismatches = 0;
+            sync_last_ba = sync_last_vic_ba = true;
+            sync_stream_edge = sync_vic_edge = false;
+        }
+        else
+        {
+            sync_held_cycles++;
         }
         
-        if (quit_requested)
+        if (__atomic_load_n(&quit_requested, __ATOMIC_RELAXED))
         {
             printf("Quit requested (%d)\n", cycle_counter);
             break;
@@ -399,17 +968,126 @@ int main()
                 }
                 else
                 {
-                    cpu.data = data;
+                    cpu.data = mem_read(address, data);
                 }
             }
 
+            memmove(&step_cycle[1], &step_cycle[0], sizeof(step_cycle) - sizeof(step_cycle[0]));
+            step_cycle[0] = cycle_counter;
+            step_count++;
             step6502();
         }
     }
 
+    printf("Interrupts: %u predicted, %u by look-ahead. CIA mismatches: %u, %u. VIC collision mismatches: %u\n",
+        interrupts_predicted, interrupts_seen, cia1.mismatches, cia2.mismatches, clx_mismatches);
+    printf("Frames skipped: %u. Lowest DMA headroom: %u cycles\n",
+        frames_skipped, governor_min_headroom);
+    printf("VIC-II sync: %s, locked %u times, lost %u times, %u phase corrections, %u cycles held. BA mismatches: %u\n",
+        vic_in_sync ? "locked" : "not locked", sync_locks, sync_losses, sync_corrections, sync_held_cycles, sync_mismatches);
+
     cleanup_smi();
     sound_close();
     display_close();
+    record_close();
+    latency_print();
 
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    // VIC-II model of the C64, PAL unless given on the command line, shm
+    // to publish the frames in shared memory and record=<file> to record
+    // them. The arguments after them are for the display
+    enum { MODEL_PAL, MODEL_NTSC, MODEL_NTSC_OLD } model = MODEL_PAL;
+    int arg = 1;
+    if (argc > arg)
+    {
+        if (!strcmp(argv[arg], "ntsc"))
+        {
+            model = MODEL_NTSC;
+            arg++;
+        }
+        else if (!strcmp(argv[arg], "ntsc-old"))
+        {
+            model = MODEL_NTSC_OLD;
+            arg++;
+        }
+        else if (!strcmp(argv[arg], "pal"))
+        {
+            arg++;
+        }
+    }
+    bool shm = argc > arg && !strcmp(argv[arg], "shm");
+    if (shm)
+    {
+        arg++;
+    }
+    const char *record_filename = NULL;
+    if (argc > arg && !strncmp(argv[arg], "record=", 7))
+    {
+        record_filename = argv[arg++] + 7;
+    }
+
+    // Catch all signals (like ctrl+c, ctrl+z, ...) to ensure DMA is disabled,
+    // except SIGUSR1 that prints the latency stats. SIGXFSZ is ignored, a
+    // recording past the file size limit fails and stops on its own
+    for (int i = 0; i < 64; i++)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = LatencyStats && i == SIGUSR1 ? latency_request_print : cleanup_smi_and_exit;
+        if (i == SIGXFSZ)
+        {
+            sa.sa_handler = SIG_IGN;
+        }
+        sigaction(i, &sa, NULL);
+    }
+
+    id_t pid = getpid();  
+    setpriority(PRIO_PROCESS, pid, -20);
+
+    FILE *rom_file = fopen("char.rom", "r");
+    if (rom_file != NULL)
+    {
+        if (fread(char_rom, sizeof(char_rom), 1, rom_file) != 1)
+        {
+            fprintf(stderr, "Failed to read data from char.rom file\n");
+            return 1;
+        }
+        fclose(rom_file);
+    }
+    else
+    {
+        fprintf(stderr, "Failed to open char.rom file for reading\n%s\n",
+            strerror(errno));
+        return 1;
+    }
+
+	if (!display_init(argc - arg, argv + arg))
+    {
+        fprintf(stderr, "Failed to init display\n");
+        return 1;
+    }
+
+    if (shm && !(model == MODEL_NTSC ? shm_frames_init<vic_6567r8>() :
+        model == MODEL_NTSC_OLD ? shm_frames_init<vic_6567r56a>() : shm_frames_init<vic_6569>()))
+    {
+        return 1;
+    }
+    if (record_filename != NULL && !record_init(record_filename))
+    {
+        return 1;
+    }
+
+    switch (model)
+    {
+        case MODEL_NTSC:
+            return run<vic_6567r8>();
+        case MODEL_NTSC_OLD:
+            return run<vic_6567r56a>();
+        default:
+            return run<vic_6569>();
+    }
+}
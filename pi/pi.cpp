@@ -57,6 +57,16 @@ static uint32_t dma_cb_bus_addr[5];
 
 static uint32_t cb_index, current_cb;
 
+// Size of the DMA ring in bus cycles (two 16-bit words per cycle)
+static const uint32_t smi_ring_cycles = 4*chunck_size/(2*sizeof(uint16_t));
+
+// Lowest number of cycles the DMA could write before overwriting the chunk
+// being read, since the last call of smi_headroom()
+static uint32_t min_headroom = smi_ring_cycles;
+
+// Headroom when the last chunk was fetched
+static uint32_t chunk_headroom;
+
 //
 // Map the physical address of a peripheral into virtual address space.
 //
@@ -455,6 +465,39 @@ static bool start_smi_dma()
     return true;
 }
 
+//
+// Note how far the DMA is from overwriting the chunk being read
+//
+static void note_headroom()
+{
+    uint32_t cb = dma[DMA_CONBLK_AD_REG(dma_ch)];
+    uint32_t remaining = dma[DMA_TXFR_LN_REG(dma_ch)];
+    uint32_t headroom = smi_ring_cycles;
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        if (cb == dma_cb_bus_addr[i])
+        {
+            // The rest of the chunk being written and the chunks up to the one being read
+            headroom = i == cb_index ? 0 :
+                (remaining + ((cb_index - i + 3) % 4) * chunck_size) / (2*sizeof(uint16_t));
+        }
+    }
+
+    chunk_headroom = headroom;
+    if (headroom < min_headroom)
+    {
+        min_headroom = headroom;
+    }
+}
+
+static uint32_t smi_headroom()
+{
+    uint32_t result = min_headroom;
+    min_headroom = smi_ring_cycles;
+    return result;
+}
+
 static uint16_t *get_next_smi_chunk()
 {
     cb_index++;
@@ -465,6 +508,7 @@ static uint16_t *get_next_smi_chunk()
 
     if (dma_cb_bus_addr[cb_index] != current_cb)
     {
+        note_headroom();
         return chunk_virt_addr[cb_index];
     }
 
@@ -475,6 +519,7 @@ static uint16_t *get_next_smi_chunk()
         if (new_cb != current_cb && new_cb != dma_cb_bus_addr[4])
         {
             current_cb = new_cb;
+            note_headroom();
             return chunk_virt_addr[cb_index];
         }
 
@@ -483,6 +528,7 @@ static uint16_t *get_next_smi_chunk()
 
     printf("DMA done\n");
     cleanup_smi();
+    record_close();
     exit(1);
 }
 
@@ -506,6 +552,15 @@ static void cleanup_smi()
 
 static void cleanup_smi_and_exit(int sig)
 {
+  // Let the emulation loop return, so that the recording and the stats are
+  // finished from the normal exit path. Not after a fault, or if the loop
+  // didn't see the first request
+  bool fault = sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE || sig == SIGABRT;
+  if (!fault && !__atomic_exchange_n(&quit_requested, true, __ATOMIC_RELAXED))
+  {
+    return;
+  }
+
   printf("\nExiting with error; caught signal: %i\n", sig);
   cleanup_smi();
   exit(1);
@@ -0,0 +1,315 @@
+/*
+ *  Recording of the frames into a file, see record.h. The VIC copies each
+ *  completed frame into a queue at vblank, a worker thread encodes the
+ *  frames against the previous one and writes them
+ */
+
+#include "record.h"
+
+static const int RECORD_QUEUE = 8;         // Frames copied and not encoded yet
+
+struct record_entry
+{
+    pixel_t pixels[DISPLAY_X*DISPLAY_Y];
+    uint64_t cycle;
+};
+
+static FILE *record_file;                  // NULL if not recording
+static bool record_stopped;                // Flag: Writing failed, frames are no longer queued
+static record_file_header record_header;
+static record_entry record_queue[RECORD_QUEUE];
+static uint32_t record_queued;             // Frames put into the queue
+static uint32_t record_taken;              // Frames taken from the queue by the worker
+static uint32_t record_dropped;            // Frames not recorded because the queue was full
+static uint64_t record_cycle;              // 64 bit cycle counter
+static uint32_t record_last_cycle;         // cycle_counter at the last frame
+
+// Worker thread
+static pthread_t record_thread;
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_cond = PTHREAD_COND_INITIALIZER;
+static bool record_quit;                   // Flag: Worker must exit when the queue is empty
+
+// Encoder state, only used by the worker
+static uint8_t record_prev[DISPLAY_X*DISPLAY_Y];   // Last frame written
+static uint8_t *record_buffer;             // Encoded frame
+static record_index_entry *record_index;   // Key frames
+static uint64_t record_index_size;
+static uint64_t record_frames, record_bytes;
+static uint64_t record_encode_ns, record_encode_max_ns;
+static int record_error;                   // errno of the write that failed, 0 if none
+
+static void *record_main(void *arg);
+
+
+/*
+ *  Writing the file, the recording is stopped at the first error (like a
+ *  full disk) and the file left as it is
+ */
+
+static void record_fail(int error)
+{
+    if (record_error == 0)
+    {
+        record_error = error ? error : EIO;
+        fprintf(stderr, "Recording stopped after %llu frames, writing the file failed: %s\n",
+            (unsigned long long)record_frames, strerror(record_error));
+        __atomic_store_n(&record_stopped, true, __ATOMIC_RELAXED);
+    }
+}
+
+static bool record_write(const void *p, size_t size)
+{
+    if (record_error == 0 && fwrite(p, size, 1, record_file) != 1)
+    {
+        record_fail(errno);
+    }
+    return record_error == 0;
+}
+
+// Write the header at the start of the file and return to pos
+static bool record_write_header(off_t pos)
+{
+    if (record_error == 0 && fseeko(record_file, 0, SEEK_SET) != 0)
+    {
+        record_fail(errno);
+    }
+    if (record_write(&record_header, sizeof(record_header)) && fseeko(record_file, pos, SEEK_SET) != 0)
+    {
+        record_fail(errno);
+    }
+    return record_error == 0;
+}
+
+
+/*
+ *  Open the file and start the worker thread
+ */
+
+static bool record_init(const char *filename)
+{
+#ifndef INDEXED_DISPLAY
+    fprintf(stderr, "Recording needs INDEXED_DISPLAY\n");
+    return false;
+#endif
+
+    if ((record_file = fopen(filename, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n%s\n", filename, strerror(errno));
+        return false;
+    }
+    setvbuf(record_file, NULL, _IOFBF, 1024*1024);
+
+    memcpy(record_header.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+    record_header.header_size = sizeof(record_header);
+    record_header.width = DISPLAY_X;
+    record_header.height = DISPLAY_Y;
+    record_header.key_interval = RECORD_KEY_INTERVAL;
+    memcpy(record_header.palette, palette, sizeof(palette));
+
+    record_buffer = (uint8_t *)malloc(DISPLAY_Y/8 + 1 + DISPLAY_Y*record_max_line(DISPLAY_X));
+    if (!record_write(&record_header, sizeof(record_header)) || record_buffer == NULL ||
+        pthread_create(&record_thread, NULL, record_main, NULL) != 0)
+    {
+        fclose(record_file);
+        record_file = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ *  Write the pending frames and the index, and close the file
+ */
+
+static void record_close(void)
+{
+    if (record_file == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&record_mutex);
+    record_quit = true;
+    pthread_cond_signal(&record_cond);
+    pthread_mutex_unlock(&record_mutex);
+    pthread_join(record_thread, NULL);
+
+    // A recording that failed is left without the index, it can be read up
+    // to the damaged frame
+    off_t pos = ftello(record_file);
+    if (!record_error)
+    {
+        record_header.index_offset = pos;
+        record_header.index_entries = record_index_size;
+        record_header.frames = record_frames;
+        if (record_index_size != 0)
+        {
+            record_write(record_index, sizeof(record_index_entry) * record_index_size);
+        }
+        record_write_header(pos);
+    }
+    if (fclose(record_file) != 0)
+    {
+        record_fail(errno);
+    }
+    record_file = NULL;
+
+    if (record_frames)
+    {
+        printf("Recording: %llu frames, %llu bytes (%.0f bytes per frame), encoded in %.0f us per frame (max %.0f us), %u dropped\n",
+            (unsigned long long)record_frames, (unsigned long long)record_bytes, (double)record_bytes / record_frames,
+            record_encode_ns / 1000.0 / record_frames, record_encode_max_ns / 1000.0, record_dropped);
+    }
+    if (record_error)
+    {
+        printf("Recording: FAILED, writing the file: %s. It is incomplete\n", strerror(record_error));
+    }
+    free(record_buffer);
+    free(record_index);
+}
+
+
+/*
+ *  Queue a completed frame, called at vblank. A frame is dropped rather
+ *  than waiting for the worker
+ */
+
+template <class M> static void record_frame(const display_frame *f)
+{
+    if (record_file == NULL || __atomic_load_n(&record_stopped, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    record_cycle += (uint32_t)(cycle_counter - record_last_cycle);
+    record_last_cycle = cycle_counter;
+
+    if (record_queued - __atomic_load_n(&record_taken, __ATOMIC_ACQUIRE) == RECORD_QUEUE)
+    {
+        record_dropped++;
+        return;
+    }
+
+    record_entry *e = &record_queue[record_queued % RECORD_QUEUE];
+    memcpy(e->pixels, f->pixels, sizeof(e->pixels));
+    e->cycle = record_cycle;
+    if (record_queued == 0)
+    {
+        record_header.frame_rate_num = M::CLOCK_FREQ;
+        record_header.frame_rate_den = M::CYCLES_PER_LINE * M::TOTAL_RASTERS;
+    }
+
+    pthread_mutex_lock(&record_mutex);
+    __atomic_store_n(&record_queued, record_queued + 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&record_cond);
+    pthread_mutex_unlock(&record_mutex);
+}
+
+
+/*
+ *  Encode a frame against the last one, all lines of a key frame are
+ *  encoded on their own
+ */
+
+static void record_encode(const record_entry *e)
+{
+    const uint8_t *p = (const uint8_t *)e->pixels;
+    bool key = record_frames % RECORD_KEY_INTERVAL == 0;
+    uint8_t *changed = record_buffer;
+    uint8_t *out = record_buffer + (DISPLAY_Y+7)/8;
+    record_frame_header fh;
+
+    memset(changed, 0, (DISPLAY_Y+7)/8);
+    fh.changed = 0;
+    for (int y=0; y<DISPLAY_Y; y++)
+    {
+        const uint8_t *line = p + y*DISPLAY_X;
+        uint8_t *prev = record_prev + y*DISPLAY_X;
+        if (!key && !memcmp(line, prev, DISPLAY_X))
+        {
+            continue;
+        }
+
+        changed[y/8] |= 1 << (y%8);
+        fh.changed++;
+        out = record_encode_line(out, line, key ? NULL : prev, y ? line - DISPLAY_X : NULL, DISPLAY_X);
+        memcpy(prev, line, DISPLAY_X);
+    }
+
+    // Unchanged frames are only a header
+    fh.magic = RECORD_FRAME_MAGIC;
+    fh.size = fh.changed ? out - record_buffer : 0;
+    fh.frame = record_frames + 1;
+    fh.cycle = e->cycle;
+    fh.key = key;
+
+    if (key)
+    {
+        if ((record_index_size & (record_index_size - 1)) == 0)
+        {
+            record_index = (record_index_entry *)realloc(record_index,
+                (record_index_size ? 2*record_index_size : 16) * sizeof(record_index_entry));
+        }
+        record_index_entry *ie = &record_index[record_index_size++];
+        ie->frame = fh.frame;
+        ie->cycle = fh.cycle;
+        ie->offset = ftello(record_file);
+    }
+
+    if (record_write(&fh, sizeof(fh)) && (fh.size == 0 || record_write(record_buffer, fh.size)))
+    {
+        record_frames++;
+        record_bytes += sizeof(fh) + fh.size;
+    }
+}
+
+
+/*
+ *  Worker thread, encodes the frames in the order they were queued
+ */
+
+static void *record_main(void *arg)
+{
+    (void)arg; // ignore
+
+    pthread_mutex_lock(&record_mutex);
+    for (;;)
+    {
+        while (record_taken == __atomic_load_n(&record_queued, __ATOMIC_ACQUIRE) && !record_quit)
+        {
+            pthread_cond_wait(&record_cond, &record_mutex);
+        }
+        if (record_taken == __atomic_load_n(&record_queued, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        pthread_mutex_unlock(&record_mutex);
+
+        // The header has the frame rate of the model once there is a frame.
+        // After a failed write the queued frames are only taken
+        if (record_frames == 0 && !record_error)
+        {
+            record_write_header(ftello(record_file));
+        }
+
+        if (!record_error)
+        {
+            uint64_t start = latency_now();
+            record_encode(&record_queue[record_taken % RECORD_QUEUE]);
+            uint64_t ns = latency_now() - start;
+            record_encode_ns += ns;
+            if (ns > record_encode_max_ns)
+            {
+                record_encode_max_ns = ns;
+            }
+        }
+
+        pthread_mutex_lock(&record_mutex);
+        __atomic_store_n(&record_taken, record_taken + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&record_mutex);
+
+    return NULL;
+}
@@ -0,0 +1,182 @@
+/*
+ *  Recording of the VIC output, lossless, in color indexes
+ *
+ *  File: record_file_header, then the frames, each a record_frame_header
+ *  and the encoded lines, then the index of the key frames. The index is
+ *  written when the recording is closed, a file without it can still be
+ *  read front to back. All numbers are little-endian
+ *
+ *  Frame: a bitmap of the changed lines (bit y%8 of byte y/8), then the
+ *  tokens of each changed line. Key frames have all lines changed and
+ *  don't refer to the previous frame. A token byte has the operation in
+ *  the upper two bits and the number of pixels minus one in the lower six:
+ *
+ *    SKIP  n pixels are the same as in the previous frame
+ *    ABOVE n pixels are the same as in the line above
+ *    RUN   n pixels of the color in the next byte
+ *    LIT   n pixels in the next (n+1)/2 bytes, two per byte, low nibble first
+ */
+
+static const char RECORD_MAGIC[8] = {'C', '6', '4', 'R', 'E', 'C', '0', '1'};
+static const uint32_t RECORD_FRAME_MAGIC = 0x4d415246;	// "FRAM"
+static const uint32_t RECORD_KEY_INTERVAL = 250;		// Frames from one key frame to the next
+
+enum
+{
+	RECORD_SKIP, RECORD_ABOVE, RECORD_RUN, RECORD_LIT
+};
+
+struct record_file_header
+{
+	char magic[8];
+	uint32_t header_size;		// Offset of the first frame
+	uint32_t width, height;
+	uint32_t frame_rate_num;	// Frame rate of the C64, cycles per second...
+	uint32_t frame_rate_den;	// ... and per frame
+	uint32_t key_interval;
+	uint32_t palette[16];		// RGBA colors of the indexes
+	uint64_t index_offset;		// Offset of the index, 0 if not written
+	uint64_t index_entries;
+	uint64_t frames;			// Frames in the file, 0 if not closed
+};
+
+struct record_frame_header
+{
+	uint32_t magic;				// RECORD_FRAME_MAGIC
+	uint32_t size;				// Bytes following this header
+	uint64_t frame;				// Number of the frame, from 1
+	uint64_t cycle;				// C64 cycle at the vblank of the frame
+	uint32_t key;				// Flag: Key frame
+	uint32_t changed;			// Number of changed lines
+};
+
+struct record_index_entry
+{
+	uint64_t frame;				// Key frame
+	uint64_t cycle;
+	uint64_t offset;			// Offset of its record_frame_header
+};
+
+// Bound of the size of an encoded line, a token of one pixel is never
+// followed by another one
+inline static int record_max_line(int width)
+{
+	return 2*width;
+}
+
+// Pixels equal to ref from the start, at most 64
+inline static int record_match(const uint8_t *p, const uint8_t *ref, int n)
+{
+	int i;
+	if (n > 64)
+		n = 64;
+	for (i=0; i<n && p[i] == ref[i]; i++);
+	return i;
+}
+
+inline static uint8_t *record_put_lit(uint8_t *out, const uint8_t *p, int n)
+{
+	*out++ = RECORD_LIT << 6 | (n - 1);
+	for (int i=0; i<n; i+=2)
+		*out++ = p[i] | (i+1 < n ? p[i+1] << 4 : 0);
+	return out;
+}
+
+/*
+ *  Encode a line of width pixels, prev is the line in the previous frame
+ *  (NULL in key frames), above the line above (NULL in the first line).
+ *  Returns the end of the tokens
+ */
+
+inline static uint8_t *record_encode_line(uint8_t *out, const uint8_t *p, const uint8_t *prev, const uint8_t *above, int width)
+{
+	int lit = 0;	// Pixels waiting to be written as literals
+
+	for (int x=0; x<width;) {
+		int left = width - x;
+		int run = record_match(p + x + 1, p + x, left - 1) + 1;
+		int skip = prev ? record_match(p + x, prev + x, left) : 0;
+		int up = above ? record_match(p + x, above + x, left) : 0;
+		if (run > 64)
+			run = 64;
+
+		int op = RECORD_RUN, n = run;
+		if (skip >= n) {
+			op = RECORD_SKIP;
+			n = skip;
+		}
+		if (up > n) {
+			op = RECORD_ABOVE;
+			n = up;
+		}
+
+		// Short matches are cheaper as literals
+		if (n < 3) {
+			if (++lit == 64) {
+				out = record_put_lit(out, p + x + 1 - lit, lit);
+				lit = 0;
+			}
+			x++;
+			continue;
+		}
+
+		if (lit) {
+			out = record_put_lit(out, p + x - lit, lit);
+			lit = 0;
+		}
+		*out++ = op << 6 | (n - 1);
+		if (op == RECORD_RUN)
+			*out++ = p[x];
+		x += n;
+	}
+
+	if (lit)
+		out = record_put_lit(out, p + width - lit, lit);
+	return out;
+}
+
+/*
+ *  Decode a line in place, p holds the line of the previous frame. Returns
+ *  the end of the tokens, NULL if they are invalid
+ */
+
+inline static const uint8_t *record_decode_line(const uint8_t *in, const uint8_t *end, uint8_t *p, const uint8_t *above, int width)
+{
+	for (int x=0; x<width;) {
+		if (in >= end)
+			return NULL;
+
+		int op = *in >> 6, n = (*in++ & 63) + 1;
+		if (n > width - x)
+			return NULL;
+
+		switch (op) {
+			case RECORD_SKIP:
+				break;
+
+			case RECORD_ABOVE:
+				if (above == NULL)
+					return NULL;
+				memcpy(p + x, above + x, n);
+				break;
+
+			case RECORD_RUN:
+				if (in >= end)
+					return NULL;
+				memset(p + x, *in++ & 15, n);
+				break;
+
+			default:
+				if (end - in < (n + 1) / 2)
+					return NULL;
+				for (int i=0; i<n; i+=2, in++) {
+					p[x+i] = *in & 15;
+					if (i+1 < n)
+						p[x+i+1] = *in >> 4;
+				}
+				break;
+		}
+		x += n;
+	}
+	return in;
+}
@@ -0,0 +1,219 @@
+/*
+ *  Reference consumer of the frames published in shared memory (emulator
+ *  started with shm). Reads each new frame in place and prints the frame
+ *  arrival rate once per second
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm_frames.h"
+
+static const long POLL_NS = 1000000;    // Poll interval for new frames
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(long ns)
+{
+    struct timespec ts = {0, ns};
+    nanosleep(&ts, NULL);
+}
+
+
+/*
+ *  Map the segment, waits until the emulator has set it up
+ */
+
+static shm_frames_header *open_frames(size_t *size, ino_t *ino)
+{
+    bool waiting = false;
+
+    for (;;)
+    {
+        int fd = shm_open(SHM_FRAMES_NAME, O_RDONLY, 0);
+        if (fd >= 0)
+        {
+            struct stat st;
+            void *p = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(shm_frames_header))
+            {
+                p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+
+            if (p != MAP_FAILED)
+            {
+                shm_frames_header *h = (shm_frames_header *)p;
+                if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == SHM_FRAMES_MAGIC &&
+                    h->version == SHM_FRAMES_VERSION &&
+                    (off_t)(h->header_size + h->slots * h->slot_size) <= st.st_size)
+                {
+                    *size = st.st_size;
+                    *ino = st.st_ino;
+                    return h;
+                }
+                munmap(p, st.st_size);
+            }
+        }
+        else if (errno != ENOENT)
+        {
+            fprintf(stderr, "Failed to open shared memory %s\n%s\n", SHM_FRAMES_NAME, strerror(errno));
+            return NULL;
+        }
+
+        if (!waiting)
+        {
+            printf("Waiting for the emulator to publish frames\n");
+            fflush(stdout);
+            waiting = true;
+        }
+        sleep_ns(100 * POLL_NS);
+    }
+}
+
+
+// Flag: The emulator was restarted, the segment of the name isn't the mapped one
+static bool frames_replaced(ino_t ino)
+{
+    struct stat st;
+    int fd = shm_open(SHM_FRAMES_NAME, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool replaced = fstat(fd, &st) == 0 && st.st_ino != ino;
+    close(fd);
+    return replaced;
+}
+
+
+/*
+ *  Read a frame in place, here the pixels are only summed up. Returns false
+ *  if the emulator wrote the slot meanwhile (the frame is torn)
+ */
+
+static bool read_frame(shm_frames_header *h, uint64_t n, uint64_t *cycle, uint32_t *sum)
+{
+    shm_frames_slot *slot = shm_frames_slot_of(h, n);
+
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+    {
+        return false;
+    }
+
+    *cycle = slot->cycle;
+    bool same_frame = slot->frame == n;
+    const uint8_t *p = shm_frames_pixels(slot);
+    uint32_t s = 0;
+    for (uint32_t i=0; i<h->width * h->height * h->bytes_per_pixel; i++)
+    {
+        s += p[i];
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq || !same_frame)
+    {
+        return false;
+    }
+    *sum = s;
+    return true;
+}
+
+
+int main(void)
+{
+    size_t size;
+    ino_t ino;
+    shm_frames_header *h = NULL;
+
+    uint64_t last = 0, last_cycle = 0;
+    uint32_t received = 0, missed = 0, torn = 0, sum = 0;
+    uint64_t cycles = 0, max_gap_ns = 0;
+    uint64_t window_ns = now_ns(), arrival_ns = window_ns;
+
+    for (;;)
+    {
+        if (h == NULL)
+        {
+            if ((h = open_frames(&size, &ino)) == NULL)
+            {
+                return 1;
+            }
+            printf("Frames from pid %u: %ux%u, %s, %u slots\n", h->producer_pid, h->width, h->height,
+                h->format == SHM_FORMAT_INDEXED8 ? "indexed" : "RGBA", h->slots);
+            last = __atomic_load_n(&h->frames, __ATOMIC_ACQUIRE);
+            last_cycle = 0;
+        }
+
+        uint64_t n = __atomic_load_n(&h->frames, __ATOMIC_ACQUIRE);
+        uint64_t now = now_ns();
+
+        if (n > last)
+        {
+            // Frames overwritten before they were read are missed, their
+            // cycles are still counted
+            missed += n - last - 1;
+
+            uint64_t cycle;
+            if (read_frame(h, n, &cycle, &sum))
+            {
+                received++;
+                if (last_cycle)
+                {
+                    cycles += cycle - last_cycle;
+                }
+                last_cycle = cycle;
+            }
+            else
+            {
+                torn++;
+                last_cycle = 0;
+            }
+            last = n;
+
+            if (now - arrival_ns > max_gap_ns)
+            {
+                max_gap_ns = now - arrival_ns;
+            }
+            arrival_ns = now;
+        }
+
+        if (now - window_ns >= 1000000000)
+        {
+            double s = (now - window_ns) / 1e9;
+            double c64_hz = (double)h->frame_rate_num / (h->frame_rate_den ? h->frame_rate_den : 1);
+            double frames = cycles ? (double)cycles / h->frame_rate_den : 0;
+            printf("%7.3f frames/s (%5.1f%% of %.4f Hz by the cycles), %u missed, %u torn, max gap %.1f ms, sum %08x\n",
+                received / s, frames / s / c64_hz * 100, c64_hz, missed, torn, max_gap_ns / 1e6, sum);
+            fflush(stdout);
+
+            // No frames, the emulator may have exited or started over
+            if (received == 0 && frames_replaced(ino))
+            {
+                printf("Emulator restarted\n");
+                munmap(h, size);
+                h = NULL;
+            }
+
+            received = missed = torn = 0;
+            cycles = max_gap_ns = 0;
+            window_ns = now;
+        }
+
+        sleep_ns(POLL_NS);
+    }
+}
@@ -0,0 +1,154 @@
+/*
+ *  Publish the completed frames in shared memory, see shm_frames.h
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm_frames.h"
+
+static shm_frames_header *shm_frames;      // Mapped segment, NULL if frames aren't published
+static size_t shm_frames_size;
+static uint64_t shm_frames_cycle;          // 64 bit cycle counter
+static uint32_t shm_frames_last_cycle;     // cycle_counter at the last frame
+
+static void shm_frames_close(void);
+
+
+/*
+ *  Create the segment, or take over the one of an earlier run. Readers
+ *  that still map an old segment keep reading its last frames. The
+ *  segment of an emulator that is still running is left alone
+ */
+
+// Process publishing in the segment of the name, 0 if none is running
+static pid_t shm_frames_producer(void)
+{
+    int fd = shm_open(SHM_FRAMES_NAME, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    pid_t pid = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(shm_frames_header))
+    {
+        void *p = mmap(NULL, sizeof(shm_frames_header), PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            const shm_frames_header *h = (const shm_frames_header *)p;
+            if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == SHM_FRAMES_MAGIC)
+            {
+                pid = h->producer_pid;
+            }
+            munmap(p, sizeof(shm_frames_header));
+        }
+    }
+    close(fd);
+
+    return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM) ? pid : 0;
+}
+
+template <class M> static bool shm_frames_init(void)
+{
+    uint32_t header_size = (sizeof(shm_frames_header) + 63) & ~63;
+    uint32_t slot_size = (sizeof(shm_frames_slot) + DISPLAY_X*DISPLAY_Y*sizeof(pixel_t) + 63) & ~63;
+    shm_frames_size = header_size + SHM_FRAMES_SLOTS*slot_size;
+
+    pid_t producer = shm_frames_producer();
+    if (producer != 0)
+    {
+        fprintf(stderr, "Shared memory %s is used by the emulator running as process %d\n",
+            SHM_FRAMES_NAME, (int)producer);
+        return false;
+    }
+
+    shm_unlink(SHM_FRAMES_NAME);
+    int fd = shm_open(SHM_FRAMES_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create shared memory %s\n%s\n", SHM_FRAMES_NAME, strerror(errno));
+        return false;
+    }
+
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, shm_frames_size) == 0)
+    {
+        p = mmap(NULL, shm_frames_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map shared memory %s\n%s\n", SHM_FRAMES_NAME, strerror(errno));
+        shm_unlink(SHM_FRAMES_NAME);
+        return false;
+    }
+
+    // A new segment is zero-filled
+    shm_frames = (shm_frames_header *)p;
+    shm_frames->version = SHM_FRAMES_VERSION;
+    shm_frames->header_size = header_size;
+    shm_frames->slot_size = slot_size;
+    shm_frames->slots = SHM_FRAMES_SLOTS;
+    shm_frames->width = DISPLAY_X;
+    shm_frames->height = DISPLAY_Y;
+#ifdef INDEXED_DISPLAY
+    shm_frames->format = SHM_FORMAT_INDEXED8;
+#else
+    shm_frames->format = SHM_FORMAT_RGBA8888;
+#endif
+    shm_frames->bytes_per_pixel = sizeof(pixel_t);
+    shm_frames->frame_rate_num = M::CLOCK_FREQ;
+    shm_frames->frame_rate_den = M::CYCLES_PER_LINE * M::TOTAL_RASTERS;
+    shm_frames->producer_pid = getpid();
+    memcpy(shm_frames->palette, palette, sizeof(palette));
+    __atomic_store_n(&shm_frames->magic, SHM_FRAMES_MAGIC, __ATOMIC_RELEASE);
+
+    // Also on exit() from a signal handler or the end of a dump
+    atexit(shm_frames_close);
+    return true;
+}
+
+static void shm_frames_close(void)
+{
+    if (shm_frames != NULL)
+    {
+        munmap(shm_frames, shm_frames_size);
+        shm_unlink(SHM_FRAMES_NAME);
+        shm_frames = NULL;
+    }
+}
+
+
+/*
+ *  Publish a completed frame, called at vblank. This never waits for the
+ *  readers
+ */
+
+static void shm_frames_publish(const display_frame *f)
+{
+    if (shm_frames == NULL)
+    {
+        return;
+    }
+
+    shm_frames_cycle += (uint32_t)(cycle_counter - shm_frames_last_cycle);
+    shm_frames_last_cycle = cycle_counter;
+
+    uint64_t n = shm_frames->frames + 1;
+    shm_frames_slot *slot = shm_frames_slot_of(shm_frames, n);
+
+    uint32_t seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->frame = n;
+    slot->cycle = shm_frames_cycle;
+    slot->time_ns = latency_now();
+    memcpy(shm_frames_pixels(slot), f->pixels, sizeof(f->pixels));
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&shm_frames->frames, n, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,61 @@
+/*
+ *  Completed frames published in POSIX shared memory, for local consumers
+ *
+ *  The segment is a header followed by a ring of slots, each a slot header
+ *  and the pixels of one frame. The emulator writes frame n into slot
+ *  n % slots and never waits for readers. Each slot has a seqlock: seq is
+ *  odd while the slot is written. A reader loads seq (acquire), uses the
+ *  pixels in place and loads seq again after an acquire fence, the frame
+ *  is valid if both values are equal and even
+ */
+
+#define SHM_FRAMES_NAME "/c64_pi_frames"
+
+static const uint32_t SHM_FRAMES_MAGIC = 0x46343643;	// "C64F"
+static const uint32_t SHM_FRAMES_VERSION = 1;
+static const uint32_t SHM_FRAMES_SLOTS = 8;
+
+// Pixel formats
+enum
+{
+	SHM_FORMAT_INDEXED8 = 1,	// Color index per byte, see palette
+	SHM_FORMAT_RGBA8888 = 2		// 0xRRGGBBAA per native-endian uint32_t
+};
+
+struct shm_frames_header
+{
+	uint32_t magic;				// SHM_FRAMES_MAGIC, written last when the segment is set up
+	uint32_t version;
+	uint32_t header_size;		// Offset of slot 0
+	uint32_t slot_size;			// Bytes per slot, slot header included
+	uint32_t slots;
+	uint32_t width, height;		// Frame size in pixels
+	uint32_t format;			// SHM_FORMAT_*
+	uint32_t bytes_per_pixel;
+	uint32_t frame_rate_num;	// Frame rate of the C64, cycles per second...
+	uint32_t frame_rate_den;	// ... and per frame
+	uint32_t producer_pid;
+	uint32_t palette[16];		// RGBA colors of the indexes
+	uint64_t frames;			// Frames published, the last one is in slot (frames-1) % slots
+};
+
+struct shm_frames_slot
+{
+	uint32_t seq;				// Seqlock, odd while the slot is written
+	uint32_t pad;
+	uint64_t frame;				// Number of the frame, from 1
+	uint64_t cycle;				// C64 cycle at the vblank of the frame
+	uint64_t time_ns;			// CLOCK_MONOTONIC time it was published
+} __attribute__((aligned(64)));	// The pixels follow, width*height*bytes_per_pixel bytes
+
+// Slot of a frame, numbered from 1
+inline static shm_frames_slot *shm_frames_slot_of(shm_frames_header *h, uint64_t frame)
+{
+	return (shm_frames_slot *)((uint8_t *)h + h->header_size + ((frame - 1) % h->slots) * h->slot_size);
+}
+
+// Pixels of a slot
+inline static uint8_t *shm_frames_pixels(shm_frames_slot *slot)
+{
+	return (uint8_t *)(slot + 1);
+}
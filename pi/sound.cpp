@@ -14,14 +14,26 @@ static uint32_t dev;
 static void audio_callback(void *userdata, uint8_t *stream, int len)
 {
     (void)userdata; // ignore
-    calc_buffer((int16_t *)stream, len);
+
+    // The HUD shows the synthesis time in proportion to the audio made
+    if (__atomic_load_n(&hud_visible, __ATOMIC_RELAXED))
+    {
+        uint64_t start = latency_now();
+        calc_buffer((int16_t *)stream, len);
+        __atomic_add_fetch(&hud_sid_ns, latency_now() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&hud_audio_ns, (uint64_t)(len/2) * 1000000000 / SAMPLE_FREQ, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        calc_buffer((int16_t *)stream, len);
+    }
 }
 
 /*
  *  Initialization
  */
 
-static void sound_init(void)
+template <class M> static void sound_init(void)
 {
     SDL_AudioSpec want, have;
     ready = false;
@@ -30,7 +42,7 @@ static void sound_init(void)
     want.freq = SAMPLE_FREQ;
     want.format = AUDIO_S16LSB;
     want.channels = 1;
-    want.samples = SAMPLE_FREQ / CALC_FREQ;
+    want.samples = SAMPLE_FREQ / M::SCREEN_FREQ;    // calc_buffer is called once per frame
     want.callback = audio_callback;
     want.userdata = NULL;
 
@@ -53,20 +65,10 @@ static void sound_init(void)
 static void sound_close()
 {
     SDL_CloseAudioDevice(dev);
-}
 
-
-/*
- *  Sample volume (for sampled voice)
- */
-
-void static emulate_line_sound(void)
-{
-    SDL_LockAudioDevice(dev);
-
-    sample_buf[sample_in_ptr] = volume;
-    sample_in_ptr = (sample_in_ptr + 1) % SAMPLE_BUF_SIZE;
-
-    SDL_UnlockAudioDevice(dev);
+    if (sid_queue_dropped)
+    {
+        printf("SID: %u register writes dropped, the audio thread fell behind\n", sid_queue_dropped);
+    }
 }
 
@@ -0,0 +1,23 @@
+/*
+ *  Based on SID_none.i - 6581 emulation, no sound output
+ *  Frodo (C) 1994-1997,2002 Christian Bauer
+ */
+
+/*
+ *  Initialization, only the register values are kept
+ */
+
+template <class M> static void sound_init(void)
+{
+    ready = false;
+}
+
+
+/*
+ *  Close audio device
+ */
+
+static void sound_close()
+{
+}
+